@@ -27,21 +27,22 @@ void tsp(unsigned ncity) {
   auto H = model.fp(0.0);
 
   for (unsigned i : irange(ncity)) {
-    auto h = accumulate(irange(ncity), model.fp(0.0),
-                        [&x, i](auto v, unsigned j) { return v + x[i][j]; });
+    auto h = sum(x[i]);
     H += constraint((h - 1.0).pow(2) == 0.0, "time" + std::to_string(i));
   }
 
+  auto cities = model.sum(x, 0);
   for (unsigned j : irange(ncity)) {
-    auto h = accumulate(irange(ncity), model.fp(0.0),
-                        [&x, j](auto v, unsigned i) { return v + x[i][j]; });
+    auto h = *cities[j];
     H += constraint((h - 1.0).pow(2) == 0.0, "city" + std::to_string(j));
   }
 
+  std::vector<QuadEntry> distances;
   for (unsigned i : irange(ncity))
     for (unsigned j : irange(ncity))
       for (unsigned k : irange(ncity))
-        H += 10 * x[k][i] * x[(k + 1) % ncity][j];
+        distances.push_back({k * ncity + i, (k + 1) % ncity * ncity + j, 10});
+  H += quad_form(x, distances);
 
   // std::cout << H.as_tree() << '\n';
   FeedDict feed_dict = {{"A", 1.0}};
@@ -17,99 +17,341 @@
 
 #include "cxqubo/core/exprs.h"
 #include "cxqubo/core/poly.h"
+#include "cxqubo/core/reducer.h"
 #include "cxqubo/core/sample.h"
 #include "cxqubo/misc/debug.h"
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
 
 namespace cxqubo {
 /// Dictionary of named constants (placeholder) whose value is assigned in
 /// evaluation.
 using FeedDict = std::unordered_map<std::string_view, double>;
 
-// TODO: Add memory recycler for unordered_map.
-class Parser {
-  PolyBuilder builder;
+template <class C> class BasicParser {
+  using Poly = BasicPoly<C>;
+  using Traits = CoeffTraits<C>;
+
+  BasicPolyBuilder<C> builder;
   Context &ctx;
   const Sample &fixs;
 
-  unsigned debug_cnt = 0;
+  /// Number of remaining references to each sub-expression indexed by Expr.
+  /// Only ones referenced from multiple parents are non-zero.
+  std::vector<unsigned> shared;
+  /// Parsed polynomials of shared sub-expressions.
+  std::unordered_map<Expr, Poly> memo;
+
   static inline const char *DEBUG_PREFIX = "PARSE: ";
 
-  std::ostream &debug_enter(std::string_view process) {
-    return odbg_indent() << "PARSE(" << process << ", " << debug_cnt++
-                         << "): >> ";
-  }
-  std::ostream &debug_exit(std::string_view process) {
-    return odbg_indent() << "PARSE(" << process << ", " << --debug_cnt
-                         << "): << ";
+  std::ostream &debug_parsed(std::string_view process, Expr expr,
+                             const Poly &result) {
+    return odbg_indent() << "PARSE(" << process << "): " << expr << " = "
+                         << result << '\n';
   }
 
 public:
-  Parser(Context &ctx, const Sample &fixs)
-      : builder(ctx), ctx(ctx), fixs(fixs) {}
+  /// Variables in products of parsed polynomials are in \p domain.
+  BasicParser(Context &ctx, const Sample &fixs,
+              Vartype domain = Vartype::BINARY)
+      : builder(ctx, domain), ctx(ctx), fixs(fixs) {}
+
+  /// Parse \p root to a polynomial. Each sub-expression referenced from
+  /// multiple parents is parsed only once.
+  Poly parse(Expr root) {
+    count_shared({root});
+    auto result = post_order_visit<Poly>(root, ctx, *this);
+    builder.finalize(result);
+    memo.clear();
+    return result;
+  }
+
+  /// Parse the sum of list operands [\p first, \p last).
+  Poly parse_sum(List::iterator first, List::iterator last) {
+    count_shared(first, last);
+
+    Poly result;
+    for (auto it = first; it != last; ++it) {
+      auto poly = post_order_visit<Poly>(*it, ctx, *this);
+      if (it == first)
+        result = std::move(poly);
+      else
+        builder.add_assign(result, std::move(poly));
+    }
+    builder.finalize(result);
+    memo.clear();
+    return result;
+  }
+
+  /// Parse each list operand in [\p first, \p last) and pass its polynomial
+  /// to \p fn. Only polynomials of sub-expressions shared with later operands
+  /// are kept between calls.
+  template <class Fn>
+  void parse_each(List::iterator first, List::iterator last, Fn &&fn) {
+    count_shared(first, last);
+
+    for (auto it = first; it != last; ++it) {
+      auto poly = post_order_visit<Poly>(*it, ctx, *this);
+      builder.finalize(poly);
+      fn(std::as_const(poly));
+      builder.recycle(std::move(poly));
+    }
+    memo.clear();
+  }
 
-  Poly parse(Expr root) { return visit<Poly>(root, ctx, *this); }
   Poly operator()(Fp v, Expr expr) {
-    debug_code(debug_enter("fp") << expr << '\n');
-    auto result = builder.constant(expr);
-    debug_code(debug_exit("fp") << result << '\n');
+    auto result = builder.constant(Traits::fp(ctx, v, expr));
+    debug_code(debug_parsed("fp", expr, result));
     return result;
   }
   Poly operator()(Placeholder v, Expr expr) {
-    debug_code(debug_enter("placeholder") << expr << '\n');
-    auto result = builder.constant(expr);
-    debug_code(debug_exit("placeholder") << result << '\n');
+    auto result = builder.constant(Traits::placeholder(ctx, v, expr));
+    debug_code(debug_parsed("placeholder", expr, result));
     return result;
   }
   Poly operator()(Variable v, Expr expr) {
-    debug_code(debug_enter("variable") << expr << '\n');
     auto it = fixs.find(v.index());
     auto result = it != fixs.end()
-                      ? builder.constant(ctx.fp(double(it->second)))
+                      ? builder.constant(Traits::number(ctx, it->second))
                       : builder.variable(v);
-    debug_code(debug_exit("variable") << result << '\n');
+    debug_code(debug_parsed("variable", expr, result));
     return result;
   }
-  Poly operator()(SubH v, Expr expr) {
-    debug_code(debug_enter("subh") << expr << '\n');
-    auto result = parse(v.expr);
-    debug_code(debug_exit("subh") << result << '\n');
+
+  Poly operator()(QuadForm v, Expr expr) {
+    const auto &data = ctx.quad_form_data(v);
+    auto direct = [this](Variable var) {
+      return ctx.var_type(var) == builder.domain && !fixs.count(var.index());
+    };
+
+    Poly result;
+    if (std::all_of(data.vars.begin(), data.vars.end(), direct)) {
+      result = builder.quad_form(data);
+    } else {
+      // Variables are fixed or rewritten into the domain.
+      std::vector<Poly> xs;
+      for (auto var : data.vars)
+        xs.push_back((*this)(var, expr));
+      result = builder.constant(Traits::number(ctx, 0.0));
+      for (auto [i, j, w] : data.quad) {
+        auto term = builder.constant(Traits::number(ctx, w));
+        builder.mul_assign(term, xs[i]);
+        builder.mul_assign(term, xs[j]);
+        builder.add_assign(result, std::move(term));
+      }
+      for (auto [i, b] : data.linear) {
+        auto term = builder.constant(Traits::number(ctx, b));
+        builder.mul_assign(term, xs[i]);
+        builder.add_assign(result, std::move(term));
+      }
+      for (auto &x : xs)
+        builder.recycle(std::move(x));
+    }
+    debug_code(debug_parsed("quad_form", expr, result));
     return result;
   }
-  Poly operator()(Constraint v, Expr expr) {
-    debug_code(debug_enter("constr") << expr << '\n');
-    auto result = parse(v.expr);
-    debug_code(debug_exit("constr") << result << '\n');
-    return result;
+
+  void combine(Op op, Poly &acc, Poly &&rhs) {
+    if (op == Op::Add)
+      builder.add_assign(acc, std::move(rhs));
+    else if (op == Op::Mul)
+      builder.mul_assign(acc, std::move(rhs));
+    else
+      unreachable_code("unsupported operation");
   }
-  Poly operator()(Unary v, Expr expr) {
-    debug_code(debug_enter("unary") << expr << '\n');
-    auto result = parse(v.operand);
+
+  Poly finish(SubH v, Expr expr, Poly &&result) {
+    debug_code(debug_parsed("subh", expr, result));
+    return std::move(result);
+  }
+  Poly finish(Constraint v, Expr expr, Poly &&result) {
+    debug_code(debug_parsed("constr", expr, result));
+    return std::move(result);
+  }
+  Poly finish(Unary v, Expr expr, Poly &&result) {
     builder.neg_assign(result);
-    debug_code(debug_exit("unary") << result << '\n');
-    return result;
+    debug_code(debug_parsed("unary", expr, result));
+    return std::move(result);
   }
-  Poly operator()(List v, Expr expr) {
-    debug_code(debug_enter("list") << expr << '\n');
-    auto it = v.begin();
-    auto result = parse(*it++);
-    for (auto end = v.end(); it != end; ++it) {
-      auto rhs = parse(*it);
-      if (v.op == Op::Add)
-        builder.add_assign(result, rhs);
-      else if (v.op == Op::Mul)
-        builder.mul_assign(result, rhs);
-      else
-        unreachable_code("unsupported operation");
+  Poly finish(Pow v, Expr expr, Poly &&result) {
+    builder.pow_assign(result, v.exponent);
+    debug_code(debug_parsed("pow", expr, result));
+    return std::move(result);
+  }
+  Poly finish(List v, Expr expr, Poly &&result) {
+    debug_code(debug_parsed("list", expr, result));
+    return std::move(result);
+  }
+
+  /// Reuse the memoized polynomial of a shared sub-expression. The last
+  /// reference takes it over.
+  bool enter(Expr expr, Poly &result) {
+    if (!is_shared(expr))
+      return false;
+
+    auto it = memo.find(expr);
+    if (it == memo.end())
+      return false;
+
+    if (--shared[expr.index()] != 0) {
+      result = it->second;
+    } else {
+      result = std::move(it->second);
+      memo.erase(it);
     }
-    debug_code(debug_exit("list") << result << '\n');
-    return result;
+    return true;
+  }
+  void leave(Expr expr, const Poly &result) {
+    if (is_shared(expr)) {
+      --shared[expr.index()];
+      memo.emplace(expr, result);
+    }
+  }
+
+private:
+  bool is_shared(Expr expr) const {
+    return expr.index() < shared.size() && shared[expr.index()] != 0;
+  }
+
+  void grow_shared() {
+    if (shared.size() < ctx.num_exprs())
+      shared.resize(ctx.num_exprs());
+  }
+
+  void count_ref(Expr child, std::vector<Expr> &worklist) {
+    if (!ctx.expr_data(child).is_any_of<SubH, Constraint, Unary, Pow, List>())
+      return;
+    if (++shared[child.index()] == 1)
+      worklist.push_back(child);
+  }
+
+  /// Count shared sub-expressions of list operands [\p first, \p last).
+  void count_shared(List::iterator first, List::iterator last) {
+    std::vector<Expr> worklist;
+    grow_shared();
+    for (auto it = first; it != last; ++it)
+      count_ref(*it, worklist);
+    count_shared(std::move(worklist));
+  }
+
+  /// Count references to composite sub-expressions from distinct parents and
+  /// keep ones referenced more than once. Counts are consumed while parsing,
+  /// so \p shared is all zero after each parse.
+  void count_shared(std::vector<Expr> worklist) {
+    grow_shared();
+
+    std::vector<Expr> counted = worklist;
+    while (!worklist.empty()) {
+      const auto &data = ctx.expr_data(worklist.back());
+      worklist.pop_back();
+      size_t n = worklist.size();
+      if (auto *p = data.as_ptr_if<SubH>())
+        count_ref(p->expr, worklist);
+      else if (auto *p = data.as_ptr_if<Constraint>())
+        count_ref(p->expr, worklist);
+      else if (auto *p = data.as_ptr_if<Unary>())
+        count_ref(p->operand, worklist);
+      else if (auto *p = data.as_ptr_if<Pow>())
+        count_ref(p->base, worklist);
+      else if (auto *p = data.as_ptr_if<List>())
+        for (auto child : *p)
+          count_ref(child, worklist);
+      counted.insert(counted.end(), worklist.begin() + n, worklist.end());
+    }
+
+    // Sub-expressions referenced once are not memoized.
+    for (auto expr : counted)
+      if (shared[expr.index()] == 1)
+        shared[expr.index()] = 0;
+  }
+};
+
+/// Parser generating polynomials with numeric coefficients. The expression
+/// must not include placeholders.
+using NumParser = BasicParser<double>;
+/// Parser generating polynomials with affine coefficients of placeholders.
+using AffineParser = BasicParser<AffineCoeff>;
+
+/// Check whether an expression includes placeholders or not.
+struct PlaceholderFinder {
+  const Context &ctx;
+
+public:
+  PlaceholderFinder(const Context &ctx) : ctx(ctx) {}
+
+  bool find(Expr root) {
+    if (!ctx.has_placeholders())
+      return false;
+
+    std::vector<bool> visited(ctx.num_exprs());
+    std::vector<Expr> worklist{root};
+    auto push = [&](Expr expr) {
+      if (!visited[expr.index()]) {
+        visited[expr.index()] = true;
+        worklist.push_back(expr);
+      }
+    };
+
+    while (!worklist.empty()) {
+      const auto &data = ctx.expr_data(worklist.back());
+      worklist.pop_back();
+      if (data.is<Placeholder>())
+        return true;
+      if (auto *p = data.as_ptr_if<SubH>())
+        push(p->expr);
+      else if (auto *p = data.as_ptr_if<Constraint>())
+        push(p->expr);
+      else if (auto *p = data.as_ptr_if<Unary>())
+        push(p->operand);
+      else if (auto *p = data.as_ptr_if<Pow>())
+        push(p->base);
+      else if (auto *p = data.as_ptr_if<List>())
+        for (auto child : *p)
+          push(child);
+    }
+    return false;
+  }
+};
+
+/// Polynomial of a compiled expression. Coefficients are plain numbers if the
+/// expression has no placeholder, otherwise affine forms of placeholders.
+struct CompiledPoly : public Variant<std::monostate, NumPoly, AffinePoly> {
+  using Super = Variant<std::monostate, NumPoly, AffinePoly>;
+  using Super::Super;
+  using Super::operator=;
+
+  bool is_numeric() const { return is<NumPoly>(); }
+
+  size_t size() const {
+    if (auto *p = as_ptr_if<NumPoly>())
+      return p->size();
+    if (auto *p = as_ptr_if<AffinePoly>())
+      return p->size();
+    return 0;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const CompiledPoly &v) {
+    if (auto *p = v.as_ptr_if<NumPoly>())
+      return os << *p;
+    if (auto *p = v.as_ptr_if<AffinePoly>())
+      return os << *p;
+    return os << "<none>";
   }
 };
 
 /// Expressions represented in term and coefficient pairs.
 struct Compiled {
   Expr expr;
-  Poly poly;
+  CompiledPoly poly;
+  /// Domain of variables in products.
+  Vartype vartype = Vartype::BINARY;
+  /// Auxiliary variables of reductions, shared by copies and reused by every
+  /// conversion of the polynomial. Conversions of one Compiled must not run
+  /// concurrently.
+  std::shared_ptr<ReductionCache> reductions =
+      std::make_shared<ReductionCache>();
 
   friend std::ostream &operator<<(std::ostream &os, const Compiled &v) {
     os << "expr: " << v.expr << '\n';
@@ -120,55 +362,150 @@ struct Compiled {
 
 class Compiler {
   Context &ctx;
+  unsigned num_threads;
 
 public:
-  Compiler(Context &ctx) : ctx(ctx) {}
+  /// Minimum number of summands parsed in a task of parallel compilation.
+  static constexpr size_t MIN_CHUNK_SIZE = 64;
+  /// Maximum number of tasks of parallel compilation.
+  static constexpr size_t MAX_CHUNKS = 256;
+
+  /// \p num_threads more than 1 enables parallel compilation.
+  Compiler(Context &ctx, unsigned num_threads = 1)
+      : ctx(ctx), num_threads(num_threads) {}
 
-  Compiled compile(Expr root, const Sample &fixs = {}) {
-    Parser parser(ctx, fixs);
-    return Compiled{root, parser.parse(root)};
+  /// Compile \p root to a polynomial of variables in \p vartype domain.
+  /// Coefficients are kept in affine forms only when \p root includes
+  /// placeholders.
+  Compiled compile(Expr root, const Sample &fixs = {},
+                   Vartype vartype = Vartype::BINARY) {
+    if (PlaceholderFinder(ctx).find(root)) {
+      AffineParser parser(ctx, fixs, vartype);
+      return Compiled{root, parser.parse(root), vartype};
+    }
+
+    auto *list = ctx.expr_data(root).as_ptr_if<List>();
+    if (num_threads > 1 && list && list->op == Op::Add)
+      return Compiled{root, parse_parallel(*list, fixs, vartype), vartype};
+
+    NumParser parser(ctx, fixs, vartype);
+    return Compiled{root, parser.parse(root), vartype};
+  }
+
+private:
+  /// Parse summands of \p list in parallel. Summands are split into chunks
+  /// depending only on the list, and polynomials of chunks are merged in
+  /// order, so the result does not depend on the number of threads.
+  /// Coefficients including placeholders are not supported because they
+  /// create expressions while parsing.
+  NumPoly parse_parallel(const List &list, const Sample &fixs,
+                         Vartype vartype) {
+    size_t n = list.size();
+    size_t chunk_size =
+        std::max(MIN_CHUNK_SIZE, (n + MAX_CHUNKS - 1) / MAX_CHUNKS);
+
+    // Heads of chunks followed by the end of the list.
+    std::vector<List::iterator> heads;
+    for (size_t i = 0; i < n; i += chunk_size)
+      heads.push_back(list.begin() + i);
+    heads.push_back(list.end());
+
+    size_t nchunks = heads.size() - 1;
+    std::vector<NumPoly> results(nchunks);
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+      NumParser parser(ctx, fixs, vartype);
+      for (size_t i; (i = next++) < nchunks;)
+        results[i] = parser.parse_sum(heads[i], heads[i + 1]);
+    };
+
+    ctx.set_concurrent_products(true);
+    std::vector<std::thread> threads;
+    for (unsigned t = 1, e = std::min<size_t>(num_threads, nchunks); t < e;
+         ++t)
+      threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads)
+      thread.join();
+    ctx.set_concurrent_products(false);
+
+    BasicPolyBuilder<double> builder(ctx, vartype);
+    NumPoly result = std::move(results[0]);
+    for (size_t i = 1; i != nchunks; ++i)
+      builder.add_assign(result, results[i]);
+    return result;
   }
 };
 
+/// Fold \p value into \p acc with a List operation.
+inline void fold(Op op, double &acc, double value) {
+  if (op == Op::Add)
+    acc += value;
+  else if (op == Op::Mul)
+    acc *= value;
+  else
+    unreachable_code("unsupported operation.");
+}
+
 /// Expand placeholders.
 struct PlaceholderExpander {
   Context &ctx;
   const FeedDict &feed_dict;
+  /// Values of placeholders indexed by slot. NaN if not looked up yet.
+  std::vector<double> values;
 
 public:
   PlaceholderExpander(Context &ctx, const FeedDict &feed_dict)
-      : ctx(ctx), feed_dict(feed_dict) {}
+      : ctx(ctx), feed_dict(feed_dict),
+        values(ctx.num_placeholders(), std::nan("")) {}
 
-  double expand(Expr root) { return visit<double>(root, ctx, *this); }
+  double expand(Expr root) {
+    return post_order_visit<double>(root, ctx, *this);
+  }
+  double expand(const AffineCoeff &coeff) {
+    double result = coeff.constant;
+    for (auto [slot, c] : coeff.linear)
+      result += c * value_of(slot);
+    return coeff.rest ? result + expand(coeff.rest) : result;
+  }
 
   double operator()(Fp data, Expr target) { return data.value; }
   double operator()(Variable data, Expr target) {
     unreachable_code("variable in constant expression is not allowed.");
   }
+  double operator()(QuadForm data, Expr target) {
+    unreachable_code("variable in constant expression is not allowed.");
+  }
   double operator()(Placeholder data, Expr target) {
     auto it = feed_dict.find(data.name);
     assert(it != feed_dict.end() && "placeholder does not exist in FeedDict!");
     return it->second;
   }
-  double operator()(SubH data, Expr target) { return expand(data.expr); }
-  double operator()(Constraint data, Expr target) { return expand(data.expr); }
-  double operator()(Unary data, Expr target) {
+
+  void combine(Op op, double &acc, double value) { fold(op, acc, value); }
+
+  double finish(SubH data, Expr target, double value) { return value; }
+  double finish(Constraint data, Expr target, double value) { return value; }
+  double finish(Unary data, Expr target, double value) {
     assert(data.op == Op::Neg &&
            "unary operator without 'neg' is not supported!");
-    return -expand(data.operand);
-  }
-  double operator()(List data, Expr target) {
-    auto it = data.begin();
-    double result = expand(*it++);
-    for (auto end = data.end(); it != end; ++it) {
-      if (data.op == Op::Add)
-        result += expand(*it);
-      else if (data.op == Op::Mul)
-        result *= expand(*it);
-      else
-        unreachable_code("unsupported operation.");
-    }
-    return result;
+    return -value;
+  }
+  double finish(Pow data, Expr target, double value) {
+    return std::pow(value, data.exponent);
+  }
+  double finish(List data, Expr target, double value) { return value; }
+
+  bool enter(Expr target, double &value) { return false; }
+  void leave(Expr target, double value) {}
+
+private:
+  double value_of(unsigned slot) {
+    assert(slot < values.size() && "slot out of bounds!");
+    double &v = values[slot];
+    if (std::isnan(v))
+      v = expand(ctx.placeholder_of(slot));
+    return v;
   }
 };
 
@@ -204,7 +541,7 @@ public:
 
   double operator()(Fp data, Expr target) { return data.value; }
   double operator()(Variable data, Expr target) {
-    Vartype org_type = ctx.var_data(data).type;
+    Vartype org_type = ctx.var_type(data);
     auto it = sample->find(data.index());
     if (it != sample->end()) {
       return convert_spin_value(it->second, sample_type, org_type);
@@ -213,43 +550,51 @@ public:
     it = fixed->find(data.index());
     return it != fixed->end() ? it->second : 0.0;
   }
+  double operator()(QuadForm data, Expr target) {
+    const auto &form = ctx.quad_form_data(data);
+    std::vector<double> xs;
+    for (auto var : form.vars)
+      xs.push_back((*this)(var, target));
+
+    double result = 0.0;
+    for (auto [i, j, w] : form.quad)
+      result += w * xs[i] * xs[j];
+    for (auto [i, b] : form.linear)
+      result += b * xs[i];
+    return result;
+  }
   double operator()(Placeholder data, Expr target) {
     auto it = feed_dict.find(data.name);
     assert(it != feed_dict.end() &&
            "Placeholder which is not registered in FeedDict is found!");
     return it->second;
   }
-  double operator()(SubH data, Expr target) {
-    double result = visit_expr(data.expr);
+
+  void combine(Op op, double &acc, double value) { fold(op, acc, value); }
+
+  double finish(SubH data, Expr target, double value) {
     for (auto *observer : observers)
-      observer->subh(target, result);
-    return result;
+      observer->subh(target, value);
+    return value;
   }
-  double operator()(Constraint data, Expr target) {
-    double result = visit_expr(data.expr);
+  double finish(Constraint data, Expr target, double value) {
     for (auto *observer : observers)
-      observer->constraint(target, result);
-    return result;
+      observer->constraint(target, value);
+    return value;
   }
-  double operator()(Unary data, Expr target) {
-    return -visit_expr(data.operand);
-  }
-  double operator()(List data, Expr target) {
-    auto it = data.begin();
-    double result = visit_expr(*it++);
-    for (auto end = data.end(); it != end; ++it) {
-      if (data.op == Op::Add)
-        result += visit_expr(*it);
-      else if (data.op == Op::Mul)
-        result *= visit_expr(*it);
-      else
-        unreachable_code("unsupported operation");
-    }
-    return result;
+  double finish(Unary data, Expr target, double value) { return -value; }
+  double finish(Pow data, Expr target, double value) {
+    return std::pow(value, data.exponent);
   }
+  double finish(List data, Expr target, double value) { return value; }
+
+  bool enter(Expr target, double &value) { return false; }
+  void leave(Expr target, double value) {}
 
 private:
-  double visit_expr(Expr root) { return visit<double>(root, ctx, *this); }
+  double visit_expr(Expr root) {
+    return post_order_visit<double>(root, ctx, *this);
+  }
 };
 } // namespace cxqubo
 
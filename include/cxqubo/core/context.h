@@ -24,32 +24,102 @@
 #include "cxqubo/misc/allocator.h"
 #include "cxqubo/misc/compiler.h"
 #include "cxqubo/misc/ctor.h"
+#include "cxqubo/misc/flatmap.h"
+#include "cxqubo/misc/hasher.h"
 #include "cxqubo/misc/strsaver.h"
 #include "cxqubo/misc/vecmap.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <shared_mutex>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace cxqubo {
 /// This is important class for using CXQUBO. It owns and manages basic
 /// enetities in CXQUBO, including the variable, expression and product uniquing
 /// tables.
 class Context {
+  /// Identity of an expression for hash-consing. A list is identified as a
+  /// cons cell of its operation, first element and the rest, which is the
+  /// expression of the rest list or the last element.
+  struct ConsKey {
+    TypeIndex kind = 0;
+    Op op = Op::INVALID;
+    unsigned lhs = 0;
+    unsigned rhs = 0;
+    std::string_view label;
+
+    template <class T>
+    static ConsKey of(Op op, unsigned lhs, unsigned rhs = 0,
+                      std::string_view label = {}) {
+      return ConsKey{ExprData::index_of<T>(), op, lhs, rhs, label};
+    }
+
+    bool operator==(const ConsKey &k) const {
+      return kind == k.kind && op == k.op && lhs == k.lhs && rhs == k.rhs &&
+             label == k.label;
+    }
+  };
+  struct ConsKeyHash {
+    size_t operator()(const ConsKey &k) const {
+      size_t seed = k.kind;
+      hash_combine(seed, uint8_t(k.op), k.lhs, k.rhs, k.label);
+      return seed;
+    }
+  };
+
   StringAllocator stralloc;
-  StringSaver strsaver;
+  /// Mutable to save names of array elements when they are first asked.
+  mutable StringSaver strsaver;
   // Expression data.
   VecMap<Expr, ExprData> exprs;
-  std::unordered_map<double, Expr> fpconsts;
+  FlatMap<double, Expr> fpconsts;
   std::unordered_map<std::string_view, Expr> placeholders;
-  TypeBumpAllocator<List::Node> node_allocator;
+  std::vector<Expr> placeholder_slots;
+  TypeBumpAllocator<List::Storage> list_allocator;
+  TypeBumpAllocator<Expr> operand_allocator;
+  std::vector<QuadFormData> quad_forms;
+  /// Uniquing table of expressions built while hash-consing is enabled.
+  FlatMap<ConsKey, Expr, ConsKeyHash> consed;
+  bool hash_consing = false;
   // Variable data.
-  VecMap<Variable, VariableData> vars;
-  std::map<std::string_view, Variable> name_to_ref;
+  mutable VecMap<Variable, VariableData> vars;
+  FlatMap<std::string_view, Variable> name_to_ref;
+  /// Named variables like "x[0]" by each prefix of their names before '[',
+  /// which arrays must not name again.
+  FlatMap<std::string_view, std::vector<Variable>> bracketed_vars;
+  /// Variables of an array named like "x[3][7]". Their names are computed
+  /// from the shape instead of being saved one by one.
+  struct VarArray {
+    Variable base;
+    size_t size;
+    std::string_view basename;
+    std::vector<unsigned> shape;
+    /// Index + 1 of the previous array of the same basename, or 0.
+    unsigned prev;
+  };
+  /// Arrays ordered by their base variables.
+  std::vector<VarArray> var_arrays;
+  /// Index + 1 of the last array of each basename.
+  FlatMap<std::string_view, unsigned> basename_to_array;
   // Product data.
-  std::unordered_map<ProductData, Product> data_to_product;
-  VecMap<Product, SpanOwner<Variable>> products;
+  FlatMap<ProductSpan, Product> data_to_product;
+  /// Variable lists of products point into one bump arena, so saving a
+  /// product costs no heap allocation of its own and the lists stay in
+  /// place for the keys of 'data_to_product'.
+  VecMap<Product, ProductSpan> products;
+  TypeBumpAllocator<Variable> product_allocator;
+  /// Guard of product data while products are saved from multiple threads.
+  mutable std::shared_mutex product_mutex;
+  bool concurrent_products = false;
   // Condition data.
   VecMap<Condition, std::pair<CmpOp, double>> cmps;
-  std::unordered_map<std::pair<CmpOp, double>, Condition, PairHash> cmp_to_cond;
+  FlatMap<std::pair<CmpOp, double>, Condition, PairHash> cmp_to_cond;
 
 public:
   Context() : strsaver(stralloc) { insert_cmp(CmpOp::EQ, 0.0); }
@@ -58,31 +128,61 @@ public:
   Context(Context &&) = delete;
   Context &operator=(Context &&) = delete;
 
-  ExprData expr_data(Expr expr) const { return exprs[expr]; }
-  VariableData var_data(Variable var) const { return vars[var]; }
+  size_t num_exprs() const { return exprs.size(); }
+  size_t num_vars() const { return vars.size(); }
+
+  /// Enable or disable hash-consing. While it is enabled, building an
+  /// expression structurally identical to one built while it was enabled
+  /// returns the existing one, so repeated sub-expressions are stored once
+  /// and share memoized results.
+  void set_hash_consing(bool enable) { hash_consing = enable; }
+  bool is_hash_consing() const { return hash_consing; }
+
+  /// Return data of \p expr. The reference is invalidated when an expression
+  /// is created.
+  const ExprData &expr_data(Expr expr) const { return exprs[expr]; }
+  /// Return data of \p var. The name of an array element is computed and
+  /// saved when it is first asked, so it is not thread-safe; use 'var_type'
+  /// when only the type is needed.
+  VariableData var_data(Variable var) const {
+    auto &data = vars[var];
+    if (data.name.empty())
+      if (auto *array = array_of(var))
+        data.name = strsaver.save_string(array_var_name(*array, var));
+    return data;
+  }
+  Vartype var_type(Variable var) const { return vars[var].type; }
   ProductData product_data(Product p) const {
-    return p ? products[p].as_spanref() : ProductData();
+    if (!p)
+      return ProductData();
+    if (p.is_inline())
+      return ProductData(p);
+    if (concurrent_products) {
+      std::shared_lock lock(product_mutex);
+      return products[p];
+    }
+    return products[p];
   }
 
   bool contains_var(std::string_view name) const {
-    return name_to_ref.find(name) != name_to_ref.end();
+    return bool(find_var(name));
   }
 
   Variable var_of(std::string_view name) const {
-    auto it = name_to_ref.find(name);
-    assert(it != name_to_ref.end() && "name has not been registered!");
-    return it->second;
+    auto var = find_var(name);
+    assert(var && "name has not been registered!");
+    return var;
   }
 
   Variable expr_var(Expr expr) const {
-    auto data = expr_data(expr);
+    const auto &data = expr_data(expr);
     if (auto *p = data.as_ptr_if<Variable>())
       return *p;
     return Variable::none();
   }
 
   std::string_view expr_name(Expr expr) const {
-    auto data = expr_data(expr);
+    const auto &data = expr_data(expr);
     if (auto *p = data.as_ptr_if<Variable>())
       return var_data(*p).name;
     if (auto *p = data.as_ptr_if<Placeholder>())
@@ -94,7 +194,19 @@ public:
     return "";
   }
 
-  unsigned dim_of(Product p) const { return p ? product_data(p).size() : 0; }
+  bool has_placeholders() const { return !placeholders.empty(); }
+  size_t num_placeholders() const { return placeholder_slots.size(); }
+  /// Return a placeholder expression from its slot.
+  Expr placeholder_of(unsigned slot) const {
+    assert(slot < placeholder_slots.size() && "slot out of bounds!");
+    return placeholder_slots[slot];
+  }
+
+  unsigned dim_of(Product p) const {
+    if (p.is_inline())
+      return p.second() ? 2 : 1;
+    return p ? product_data(p).size() : 0;
+  }
 
   bool contains_cmp(CmpOp op, double rhs) const {
     return cmp_to_cond.find({op, rhs}) != cmp_to_cond.end();
@@ -112,7 +224,7 @@ public:
   Sample convert_sample(const Sample &sample, Vartype vtype) const {
     Sample result;
     for (auto [id, spin] : sample) {
-      auto origin = var_data(Variable::from(id)).type;
+      auto origin = var_type(Variable::from(id));
       result.emplace(id, convert_spin_value(spin, vtype, origin));
     }
     return result;
@@ -127,18 +239,55 @@ public:
     if (name.empty())
       return create_unnamed_var(type);
 
-    assert(name_to_ref.count(name) == 0 &&
-           "a variable with same name is found!");
+    assert(!contains_var(name) && "a variable with same name is found!");
 
     name = strsaver.save_string(name);
     auto var = vars.append({name, type});
-    name_to_ref[name] = var;
+    name_to_ref.try_emplace(name, var);
+    for (auto pos = name.find('['); pos != std::string_view::npos;
+         pos = name.find('[', pos + 1))
+      bracketed_vars[name.substr(0, pos)].push_back(var);
 
     debug_code(odbg_indent() << var << " = '" << name << "'\n");
 
     return var;
   }
 
+  /// Create variables of an array named \p basename in \p shape and return
+  /// the first one. The others follow it in row-major order. Their names
+  /// like "x[3][7]" are computed on demand. A 0-d array is one variable named
+  /// \p basename.
+  Variable create_array_vars(std::string_view basename,
+                             SpanRef<unsigned> shape, Vartype type) {
+    assert(!basename.empty() && "array of unnamed variables has no record!");
+    if (shape.empty())
+      return create_var(basename, type);
+
+    size_t size = 1;
+    for (unsigned n : shape)
+      size *= n;
+
+    basename = strsaver.save_string(basename);
+    unsigned &last = basename_to_array[basename];
+    for (unsigned i = last; i != 0; i = var_arrays[i - 1].prev)
+      assert(var_arrays[i - 1].shape.size() != shape.size() &&
+             "an array with same name is found!");
+
+    auto base = Variable::from(vars.size());
+    for (size_t i = 0; i != size; ++i)
+      vars.append({"", type});
+    var_arrays.push_back({base, size, basename,
+                          std::vector<unsigned>(shape.begin(), shape.end()),
+                          last});
+    last = var_arrays.size();
+    assert(!names_element_of(var_arrays.back()) &&
+           "a variable with same name is found!");
+
+    debug_code(odbg_indent() << base << " = '" << basename << "[...]'\n");
+
+    return base;
+  }
+
   Variable create_unnamed_var(Vartype type) {
     auto var = vars.append({"", type});
     debug_code(odbg_indent() << var << " = '<unnamed>'\n");
@@ -151,7 +300,12 @@ public:
     return result;
   }
 
-  Product mul_products(Product l, Product r) {
+  /// Return the product of two products. Variables of products stand for
+  /// values in \p domain. For BINARY, which spins are parsed into as 2x - 1,
+  /// a repeated variable is collapsed by x * x = x. For SPIN, a repeated
+  /// variable is cancelled by s * s = 1.
+  Product mul_products(Product l, Product r,
+                       Vartype domain = Vartype::BINARY) {
     if (dim_of(l) == 0)
       return r;
     if (dim_of(r) == 0)
@@ -160,40 +314,81 @@ public:
     auto lhs = product_data(l);
     auto rhs = product_data(r);
     if (lhs.size() == 1 && rhs.size() == 1)
-      return lhs[0] <= rhs[0] ? save_product({lhs[0], rhs[0]}, true)
-                              : save_product({rhs[0], lhs[0]}, true);
-
-    std::vector<Variable> vars(lhs.begin(), lhs.end());
-    vars.insert(vars.end(), rhs.begin(), rhs.end());
-    std::sort(vars.begin(), vars.end());
+      return mul_vars(lhs[0], rhs[0], domain);
+
+    // Merge sorted variables on the stack unless the degree is high.
+    size_t n = lhs.size() + rhs.size();
+    Variable buf[8];
+    std::vector<Variable> heap;
+    Variable *vars = buf;
+    if (n > std::size(buf)) {
+      heap.resize(n);
+      vars = heap.data();
+    }
+    Variable *last;
+    if (domain == Vartype::SPIN)
+      last = std::set_symmetric_difference(lhs.begin(), lhs.end(),
+                                           rhs.begin(), rhs.end(), vars);
+    else
+      last = std::set_union(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+                            vars);
+    return save_product(SpanRef<Variable>(vars, last), true);
+  }
 
-    return save_product(vars, true);
+  /// Return the product of two variables in \p domain.
+  Product mul_vars(Variable l, Variable r, Vartype domain = Vartype::BINARY) {
+    if (l == r)
+      return domain == Vartype::SPIN ? Product::none() : save_product(l, true);
+    return l < r ? save_product({l, r}, true) : save_product({r, l}, true);
   }
 
+  /// Return the product of \p vars. Repeated variables are collapsed into
+  /// one as in 'mul_products'.
   Product save_product(SpanRef<Variable> vars, bool is_sorted = false) {
     if (vars.empty())
       return Product::none();
 
+    // Products of one or two variables are inline.
+    if (vars.size() <= 2) {
+      Variable first = vars[0];
+      Variable second = vars.size() == 2 ? vars[1] : Variable::none();
+      if (first == second)
+        second = Variable::none();
+      else if (!is_sorted && second && second < first)
+        std::swap(first, second);
+      if (Product::inlinable(first))
+        return Product::inlined(first, second);
+    }
+
     std::vector<Variable> tmp;
-    if (!is_sorted) {
+    if (!is_sorted ||
+        std::adjacent_find(vars.begin(), vars.end()) != vars.end()) {
       tmp.insert(tmp.end(), vars.begin(), vars.end());
-      std::sort(tmp.begin(), tmp.end());
+      if (!is_sorted)
+        std::sort(tmp.begin(), tmp.end());
+      tmp.erase(std::unique(tmp.begin(), tmp.end()), tmp.end());
       vars = tmp;
     }
 
-    auto it = data_to_product.find(vars);
-    if (it != data_to_product.end())
-      return it->second;
-
-    Product p = products.append(span_owner(vars));
-    auto data = ProductData(products[p].as_spanref());
-    data_to_product[data] = p;
-
-    debug_code(odbg_indent() << p << " = " << data << '\n');
+    if (concurrent_products) {
+      {
+        std::shared_lock lock(product_mutex);
+        auto it = data_to_product.find(vars);
+        if (it != data_to_product.end())
+          return it->second;
+      }
+      std::unique_lock lock(product_mutex);
+      return insert_product(vars);
+    }
 
-    return p;
+    return insert_product(vars);
   }
 
+  /// Make saving products safe for calls from multiple threads. Product ids
+  /// are then given in nondeterministic order. It must be switched while no
+  /// other thread uses the context.
+  void set_concurrent_products(bool enable) { concurrent_products = enable; }
+
   Expr fp(double value) {
     auto it = fpconsts.find(value);
     if (it != fpconsts.end())
@@ -205,8 +400,11 @@ public:
   }
 
   Expr variable(Variable var) {
-    auto expr = insert_expr(var);
-    return expr;
+    auto key = ConsKey::of<Variable>(Op::INVALID, var.index());
+    if (auto e = find_consed(key))
+      return e;
+
+    return insert_consed(key, var);
   }
   std::vector<Expr> variables(SpanRef<Variable> vs) {
     std::vector<Expr> result;
@@ -221,31 +419,86 @@ public:
       return it->second;
 
     name = strsaver.save_string(name);
-    auto expr = insert_expr(make<Placeholder>(name));
+    unsigned slot = placeholder_slots.size();
+    auto expr = insert_expr(make<Placeholder>(name, slot));
     placeholders[name] = expr;
+    placeholder_slots.push_back(expr);
     return expr;
   }
 
   Expr subh(std::string_view label, Expr expr) {
-    label = strsaver.save_string(label);
-    return insert_expr(make<SubH>(label, expr));
+    auto key = ConsKey::of<SubH>(Op::INVALID, expr.index(), 0, label);
+    if (auto e = find_consed(key))
+      return e;
+
+    key.label = label = strsaver.save_string(label);
+    return insert_consed(key, make<SubH>(label, expr));
   }
   Expr constraint(std::string_view label, Expr expr, Condition cond) {
-    label = strsaver.save_string(label);
-    return insert_expr(make<Constraint>(label, expr, cond));
+    auto key = ConsKey::of<Constraint>(Op::INVALID, expr.index(),
+                                       cond.index(), label);
+    if (auto e = find_consed(key))
+      return e;
+
+    key.label = label = strsaver.save_string(label);
+    return insert_consed(key, make<Constraint>(label, expr, cond));
   }
 
   Expr neg(Expr expr) {
     if (auto e = constfold_unary(Op::Neg, expr))
       return e;
 
-    return insert_expr(make<Unary>(Op::Neg, expr));
+    auto key = ConsKey::of<Unary>(Op::Neg, expr.index());
+    if (auto e = find_consed(key))
+      return e;
+
+    return insert_consed(key, make<Unary>(Op::Neg, expr));
+  }
+
+  Expr pow(Expr base, unsigned exponent) {
+    assert(exponent > 0 && "exponent should be positive!");
+    if (exponent == 1)
+      return base;
+    auto data = expr_data(base);
+    if (auto *p = data.as_ptr_if<Fp>())
+      return fp(std::pow(p->value, exponent));
+
+    auto key = ConsKey::of<Pow>(Op::INVALID, base.index(), exponent);
+    if (auto e = find_consed(key))
+      return e;
+
+    return insert_consed(key, make<Pow>(base, exponent));
   }
 
   Expr add(Expr lhs, Expr rhs) { return binlist(Op::Add, lhs, rhs); }
   Expr sub(Expr lhs, Expr rhs) { return add(lhs, neg(rhs)); }
   Expr mul(Expr lhs, Expr rhs) { return binlist(Op::Mul, lhs, rhs); }
 
+  /// Return a new quadratic form of \p data.
+  Expr quad_form(QuadFormData data) {
+    for ([[maybe_unused]] auto [i, j, w] : data.quad)
+      assert(i < data.vars.size() && j < data.vars.size() &&
+             "index out of bounds!");
+    unsigned index = quad_forms.size();
+    quad_forms.push_back(std::move(data));
+    return insert_expr(make<QuadForm>(index));
+  }
+  const QuadFormData &quad_form_data(QuadForm form) const {
+    return quad_forms[form.index];
+  }
+
+  /// Return a new list of \p op with \p operands, which are stored at once
+  /// instead of being added one by one. The list is never hash-consed, so
+  /// it is a new expression even for a single operand.
+  Expr list(Op op, SpanRef<Expr> operands) {
+    assert(!operands.empty() && "list must have operands!");
+    unsigned n = operands.size();
+    auto *storage = new_list_storage(n, nullptr, 0);
+    std::reverse_copy(operands.begin(), operands.end(), storage->data);
+    storage->used = n;
+    return insert_expr(make<List>(op, n, storage));
+  }
+
   Condition insert_cmp(CmpOp op, double rhs) {
     auto cond = cmps.append({op, rhs});
     cmp_to_cond.emplace(std::make_pair(op, rhs), cond);
@@ -273,7 +526,7 @@ public:
   }
 
   std::ostream &draw_expr(std::ostream &os, Expr expr) const {
-    auto data = expr_data(expr);
+    const auto &data = expr_data(expr);
     if (auto *p = data.as_ptr_if<Variable>()) {
       return os << var_data(*p);
     } else if (auto *p = data.as_ptr_if<SubH>()) {
@@ -285,14 +538,19 @@ public:
     } else if (auto *p = data.as_ptr_if<Unary>()) {
       os << p->op;
       return draw_expr(os, p->operand);
+    } else if (auto *p = data.as_ptr_if<Pow>()) {
+      os << '(';
+      return draw_expr(os, p->base) << " ^ " << p->exponent << ')';
+    } else if (auto *p = data.as_ptr_if<QuadForm>()) {
+      const auto &form = quad_form_data(*p);
+      return os << "QuadForm(" << form.vars.size() << " vars, "
+                << form.quad.size() + form.linear.size() << " terms)";
     } else if (auto *p = data.as_ptr_if<List>()) {
       os << '(';
-      auto *n = p->node;
-      draw_expr(os, n->value);
-      while (n->next) {
-        n = n->next;
+      draw_expr(os, p->front());
+      for (auto it = std::next(p->begin()); it != p->end(); ++it) {
         os << ' ' << p->op << ' ';
-        draw_expr(os, n->value);
+        draw_expr(os, *it);
       }
       return os << ')';
     } else {
@@ -319,14 +577,14 @@ public:
   CXQUBO_DUMP_METHOD void dump_expr(unsigned id) const {
     dump(Expr::raw_from(id));
   }
-  CXQUBO_DUMP_METHOD void dump_product(unsigned id) const {
+  CXQUBO_DUMP_METHOD void dump_product(uint64_t id) const {
     dump(Product::raw_from(id));
   }
 
 private:
   std::ostream &draw_tree_impl(std::ostream &os, Expr expr,
                                const std::string &prefix, bool is_left) const {
-    auto data = expr_data(expr);
+    const auto &data = expr_data(expr);
 
     std::string next_prefix = prefix + (is_left ? "│  " : "   ");
     os << prefix << (is_left ? "├──" : "└──");
@@ -342,13 +600,13 @@ private:
     } else if (auto *p = data.as_ptr_if<Unary>()) {
       os << p->op << '\n';
       return draw_tree_impl(os, p->operand, next_prefix, false);
+    } else if (auto *p = data.as_ptr_if<Pow>()) {
+      os << "^ " << p->exponent << '\n';
+      return draw_tree_impl(os, p->base, next_prefix, false);
     } else if (auto *p = data.as_ptr_if<List>()) {
       os << p->op << '\n';
-      auto *n = p->node;
-      while (n) {
-        draw_tree_impl(os, n->value, next_prefix, n->next);
-        n = n->next;
-      }
+      for (auto it = p->begin(); it != p->end(); ++it)
+        draw_tree_impl(os, *it, next_prefix, std::next(it) != p->end());
       return os;
     } else {
       return draw_expr(os, expr) << "\n";
@@ -359,28 +617,156 @@ private:
     if (auto e = constfold_binary(op, lhs, rhs))
       return e;
 
-    // new_node:lhs -> node:rhs
-    auto rhs_data = expr_data(rhs);
-    if (auto rhs_p = rhs_data.as_ptr_if<List>()) {
+    // lhs, rhs...
+    if (auto rhs_p = expr_data(rhs).as_ptr_if<List>()) {
       if (rhs_p->op == op) {
-        auto *n = node_allocator.create(lhs, rhs_p->node);
-        return insert_expr(make<List>(op, n));
+        auto key = ConsKey::of<List>(op, lhs.index(), rhs.index());
+        if (auto e = find_consed(key))
+          return e;
+        return insert_consed(key, prepend(lhs, *rhs_p));
       }
     }
 
-    // new_node:rhs -> node:lhs
-    auto lhs_data = expr_data(lhs);
-    if (auto lhs_p = lhs_data.as_ptr_if<List>()) {
+    // rhs, lhs...
+    if (auto lhs_p = expr_data(lhs).as_ptr_if<List>()) {
       if (lhs_p->op == op) {
-        auto *n = node_allocator.create(rhs, lhs_p->node);
-        return insert_expr(make<List>(op, n));
+        auto key = ConsKey::of<List>(op, rhs.index(), lhs.index());
+        if (auto e = find_consed(key))
+          return e;
+        return insert_consed(key, prepend(rhs, *lhs_p));
       }
     }
 
-    // new_node:lhs -> new_node:rhs
-    auto *next = node_allocator.create(rhs);
-    auto *n = node_allocator.create(lhs, next);
-    return insert_expr(make<List>(op, n));
+    // lhs, rhs
+    auto key = ConsKey::of<List>(op, lhs.index(), rhs.index());
+    if (auto e = find_consed(key))
+      return e;
+    auto single = List{op, 1, new_list_storage(4, &rhs, 1)};
+    return insert_consed(key, prepend(lhs, single));
+  }
+
+  /// Return the list of \p head followed by operands of \p rest. \p head is
+  /// stored next to them if no other list has taken the place, and otherwise
+  /// they are copied to a new storage twice as large. So a list built up one
+  /// by one costs amortized O(1) per operand.
+  List prepend(Expr head, const List &rest) {
+    auto *storage = rest.storage;
+    if (storage->used != rest.n || storage->used == storage->capacity)
+      storage = new_list_storage(2 * (rest.n + 1), storage->data, rest.n);
+    storage->data[storage->used++] = head;
+    return List{rest.op, rest.n + 1, storage};
+  }
+
+  List::Storage *new_list_storage(unsigned capacity, const Expr *operands,
+                                  unsigned n) {
+    auto *data = static_cast<Expr *>(operand_allocator.allocate(capacity));
+    std::uninitialized_copy(operands, operands + n, data);
+    return list_allocator.create(List::Storage{data, capacity, n});
+  }
+
+  Variable find_var(std::string_view name) const {
+    auto it = name_to_ref.find(name);
+    if (it != name_to_ref.end())
+      return it->second;
+    return find_array_var(name);
+  }
+
+  /// Parse \p name like "x[3][7]" into an element of an array. Basenames
+  /// may have '[' in themselves, so \p name is split at each of them.
+  Variable find_array_var(std::string_view name) const {
+    for (auto pos = name.find('['); pos != std::string_view::npos;
+         pos = name.find('[', pos + 1)) {
+      auto it = basename_to_array.find(name.substr(0, pos));
+      if (it == basename_to_array.end())
+        continue;
+      for (unsigned i = it->second; i != 0; i = var_arrays[i - 1].prev)
+        if (auto var = parse_array_var(var_arrays[i - 1], name.substr(pos)))
+          return var;
+    }
+    return Variable::none();
+  }
+
+  /// Return true if a named variable has the name of an element of \p array.
+  bool names_element_of(const VarArray &array) const {
+    auto it = bracketed_vars.find(array.basename);
+    if (it == bracketed_vars.end())
+      return false;
+    auto n = array.basename.size();
+    for (auto var : it->second)
+      if (parse_array_var(array, vars[var].name.substr(n)))
+        return true;
+    return false;
+  }
+
+  /// Parse \p indexes like "[3][7]" into an element of \p array.
+  static Variable parse_array_var(const VarArray &array,
+                                  std::string_view indexes) {
+    const char *p = indexes.data();
+    const char *last = indexes.data() + indexes.size();
+    size_t offset = 0;
+    for (unsigned n : array.shape) {
+      if (p == last || *p++ != '[')
+        return Variable::none();
+      // Reject leading zeros, which formatted names never have.
+      if (p + 1 < last && p[0] == '0' && p[1] != ']')
+        return Variable::none();
+      unsigned i;
+      auto [q, ec] = std::from_chars(p, last, i);
+      if (ec != std::errc() || q == last || *q != ']' || i >= n)
+        return Variable::none();
+      offset = offset * n + i;
+      p = q + 1;
+    }
+    if (p != last)
+      return Variable::none();
+    return Variable::from(array.base.index() + offset);
+  }
+
+  /// Return the array including \p var, or nullptr.
+  const VarArray *array_of(Variable var) const {
+    auto it = std::upper_bound(
+        var_arrays.begin(), var_arrays.end(), var,
+        [](Variable v, const VarArray &array) { return v < array.base; });
+    if (it == var_arrays.begin())
+      return nullptr;
+    --it;
+    if (var.index() - it->base.index() >= it->size)
+      return nullptr;
+    return &*it;
+  }
+
+  static std::string array_var_name(const VarArray &array, Variable var) {
+    std::vector<size_t> indexes(array.shape.size());
+    size_t offset = var.index() - array.base.index();
+    for (size_t i = indexes.size(); i != 0; --i) {
+      indexes[i - 1] = offset % array.shape[i - 1];
+      offset /= array.shape[i - 1];
+    }
+
+    std::string name(array.basename);
+    for (size_t i : indexes) {
+      name += '[';
+      name += std::to_string(i);
+      name += ']';
+    }
+    return name;
+  }
+
+  Product insert_product(SpanRef<Variable> vars) {
+    auto it = data_to_product.find(vars);
+    if (it != data_to_product.end())
+      return it->second;
+
+    auto *mem = product_allocator.allocate(vars.size());
+    auto *ptr = static_cast<Variable *>(mem);
+    std::uninitialized_copy(vars.begin(), vars.end(), ptr);
+    auto data = ProductSpan(SpanRef<Variable>(ptr, vars.size()));
+    Product p = products.append(data);
+    data_to_product.try_emplace(data, p);
+
+    debug_code(odbg_indent() << p << " = " << data << '\n');
+
+    return p;
   }
 
   Expr insert_expr(const ExprData &data) {
@@ -389,6 +775,20 @@ private:
     return expr;
   }
 
+  Expr find_consed(const ConsKey &key) const {
+    if (!hash_consing)
+      return Expr::none();
+    auto it = consed.find(key);
+    return it != consed.end() ? it->second : Expr::none();
+  }
+
+  Expr insert_consed(const ConsKey &key, const ExprData &data) {
+    auto expr = insert_expr(data);
+    if (hash_consing)
+      consed.emplace(key, expr);
+    return expr;
+  }
+
   Expr constfold_unary(Op op, Expr operand) {
     auto data = expr_data(operand);
     auto *ep = data.as_ptr_if<Fp>();
@@ -452,7 +852,7 @@ private:
 };
 
 template <class Ret, class Fn>
-inline Ret visit(Expr root, const Context &ctx, Fn fn) {
+inline Ret visit(Expr root, const Context &ctx, Fn &&fn) {
   auto data = ctx.expr_data(root);
   if (const auto *p = data.as_ptr_if<Variable>()) {
     return fn(*p, root);
@@ -466,11 +866,113 @@ inline Ret visit(Expr root, const Context &ctx, Fn fn) {
     return fn(*p, root);
   } else if (const auto *p = data.as_ptr_if<Unary>()) {
     return fn(*p, root);
+  } else if (const auto *p = data.as_ptr_if<Pow>()) {
+    return fn(*p, root);
   } else if (const auto *p = data.as_ptr_if<List>()) {
     return fn(*p, root);
+  } else if (const auto *p = data.as_ptr_if<QuadForm>()) {
+    return fn(*p, root);
   }
   unreachable_code("invalid expression!");
 }
+
+/// Evaluate \p root in post-order with an explicit stack instead of recursion,
+/// so that deep expressions do not exhaust the call stack. \p fn is called as
+///   - fn.enter(expr, value) before visiting each node. Returning true with
+///     \p value skips the node,
+///   - fn(leaf, expr) for Fp, Variable, Placeholder and QuadForm,
+///   - fn.combine(op, acc, value) to fold operands of a List from the front,
+///   - fn.finish(node, expr, value) for SubH, Constraint, Unary, Pow and List
+///     with the (folded) value of operands,
+///   - fn.leave(expr, value) after finishing a non-leaf node.
+template <class Ret, class Fn>
+inline Ret post_order_visit(Expr root, const Context &ctx, Fn &fn) {
+  struct Frame {
+    Expr expr;
+    ExprData data;
+    /// Remaining operands of a List.
+    List::iterator next, last;
+    Ret acc{};
+    bool has_acc = false;
+  };
+  std::vector<Frame> stack;
+  Ret value{};
+
+  Expr expr = root;
+  while (true) {
+    // Descend to the first operand until a value is available.
+    while (!fn.enter(expr, value)) {
+      const auto &data = ctx.expr_data(expr);
+      if (const auto *p = data.as_ptr_if<Fp>()) {
+        value = fn(*p, expr);
+        break;
+      } else if (const auto *p = data.as_ptr_if<Variable>()) {
+        value = fn(*p, expr);
+        break;
+      } else if (const auto *p = data.as_ptr_if<Placeholder>()) {
+        value = fn(*p, expr);
+        break;
+      } else if (const auto *p = data.as_ptr_if<QuadForm>()) {
+        value = fn(*p, expr);
+        break;
+      }
+
+      Expr operand;
+      List::iterator next, last;
+      if (const auto *p = data.as_ptr_if<SubH>()) {
+        operand = p->expr;
+      } else if (const auto *p = data.as_ptr_if<Constraint>()) {
+        operand = p->expr;
+      } else if (const auto *p = data.as_ptr_if<Unary>()) {
+        operand = p->operand;
+      } else if (const auto *p = data.as_ptr_if<Pow>()) {
+        operand = p->base;
+      } else if (const auto *p = data.as_ptr_if<List>()) {
+        next = p->begin();
+        last = p->end();
+        operand = *next++;
+      } else {
+        unreachable_code("invalid expression!");
+      }
+      stack.push_back(Frame{expr, data, next, last});
+      expr = operand;
+    }
+
+    // Ascend while the operands of a node are finished.
+    while (true) {
+      if (stack.empty())
+        return value;
+
+      auto &frame = stack.back();
+      if (frame.has_acc) {
+        const ExprData &data = frame.data;
+        fn.combine(data.as<List>().op, frame.acc, std::move(value));
+      } else {
+        frame.acc = std::move(value);
+        frame.has_acc = true;
+      }
+
+      if (frame.next != frame.last) {
+        expr = *frame.next++;
+        break;
+      }
+
+      const ExprData &data = frame.data;
+      if (const auto *p = data.as_ptr_if<SubH>())
+        value = fn.finish(*p, frame.expr, std::move(frame.acc));
+      else if (const auto *p = data.as_ptr_if<Constraint>())
+        value = fn.finish(*p, frame.expr, std::move(frame.acc));
+      else if (const auto *p = data.as_ptr_if<Unary>())
+        value = fn.finish(*p, frame.expr, std::move(frame.acc));
+      else if (const auto *p = data.as_ptr_if<Pow>())
+        value = fn.finish(*p, frame.expr, std::move(frame.acc));
+      else
+        value = fn.finish(data.as<List>(), frame.expr, std::move(frame.acc));
+      fn.leave(frame.expr, value);
+      stack.pop_back();
+    }
+  }
+}
 } // namespace cxqubo
 
 #endif
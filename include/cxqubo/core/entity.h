@@ -18,6 +18,7 @@
 #include "cxqubo/misc/compare.h"
 #include "cxqubo/misc/error_handling.h"
 #include "cxqubo/misc/hasher.h"
+#include <cstdint>
 #include <functional>
 #include <ostream>
 
@@ -75,8 +76,40 @@ public:
 struct Expr : public Entity<Expr, unsigned, 'e'> {};
 /// A reference of a variable.
 struct Variable : public Entity<Variable, unsigned, 'v'> {};
-/// A reference of a product of variables.
-struct Product : public Entity<Product, unsigned, 'p'> {};
+/// A reference of a product of variables. A product of one or two variables
+/// is packed into the id itself as INLINE | first << 32 | second, where
+/// 'second' is none for one variable, so it needs no uniquing table. Other
+/// products are indexes of the table in Context.
+struct Product : public Entity<Product, uint64_t, 'p'> {
+  static inline constexpr uint64_t INLINE = uint64_t(1) << 63;
+
+  /// Return true if \p v fits in the first variable of an inline product.
+  static inline bool inlinable(Variable v) {
+    return v.raw_id() < (uint64_t(1) << 31);
+  }
+  static inline Product inlined(Variable first,
+                                Variable second = Variable::none()) {
+    assert(inlinable(first) && "variable id too large to be inlined!");
+    return raw_from(INLINE | uint64_t(first.raw_id()) << 32 |
+                    second.raw_id());
+  }
+
+  bool is_inline() const { return raw_id() & INLINE; }
+  /// Variables of an inline product.
+  Variable first() const {
+    return Variable::raw_from(unsigned(raw_id() >> 32) & ~(1u << 31));
+  }
+  Variable second() const { return Variable::raw_from(unsigned(raw_id())); }
+
+  friend std::ostream &operator<<(std::ostream &os, Product v) {
+    if (!v.is_inline())
+      return os << static_cast<const Entity &>(v);
+    os << "p(" << v.first();
+    if (v.second())
+      os << ", " << v.second();
+    return os << ')';
+  }
+};
 /// A reference of a condition check function.
 struct Condition : public Entity<Condition, unsigned, 'c'> {};
 /// Check condition of the constraints.
@@ -64,10 +64,7 @@ public:
     if (n <= 0)
       unreachable_code("`exponent` should be positive.");
 
-    Express result = *this;
-    while (--n > 0)
-      result = result * (*this);
-    return result;
+    return Express(ctx, ctx->pow(ref, n));
   }
   Express neg() const { return Express(ctx, ctx->neg(ref)); }
 
@@ -403,6 +400,90 @@ private:
 };
 
 inline size_t hash_value(const Array &v) { return v.hash(); }
+
+/// Return the sum of expressions in \p range as one list, instead of
+/// building the sum one by one with operator+.
+template <class R> inline Express sum(const R &range) {
+  std::vector<Expr> operands;
+  Context *ctx = nullptr;
+  for (const Express &e : range) {
+    ctx = e.ctx;
+    operands.push_back(e.ref);
+  }
+  assert(ctx && "sum of an empty range has no context!");
+  if (operands.size() == 1)
+    return Express(ctx, operands[0]);
+  return Express(ctx, ctx->list(Op::Add, operands));
+}
+/// Return the sum of all elements of \p array as one list.
+inline Express sum(const Array &array) {
+  if (array.ndim() == 0)
+    return *array;
+
+  std::vector<Express> operands;
+  for (unsigned i = 0, n = array.nelements(); i != n; ++i)
+    operands.push_back(array.at_offset(i));
+  return sum(operands);
+}
+/// Return the sum of elements of \p array weighted by \p coeffs as one
+/// list. Elements of zero weights are dropped.
+inline Express weighted_sum(SpanRef<double> coeffs, const Array &array) {
+  assert(coeffs.size() == array.nelements() &&
+         "coefficients must match elements of the array!");
+  auto *ctx = array.base().ctx;
+  std::vector<Expr> operands;
+  for (unsigned i = 0, n = coeffs.size(); i != n; ++i) {
+    Expr e = array.ndim() == 0 ? array.base().ref : array.at_offset(i).ref;
+    if (coeffs[i] == 0.0)
+      continue;
+    operands.push_back(coeffs[i] == 1.0 ? e : ctx->mul(ctx->fp(coeffs[i]), e));
+  }
+  if (operands.empty())
+    return Express(ctx, ctx->fp(0.0));
+  if (operands.size() == 1)
+    return Express(ctx, operands[0]);
+  return Express(ctx, ctx->list(Op::Add, operands));
+}
+/// Return the quadratic form x^T W x + b^T x of variables \p x, where \p W
+/// is given by its entries and \p b is empty or has an element for each
+/// variable. Terms are copied into the context and expanded directly at
+/// compile time instead of being built as expressions.
+inline Express quad_form(const Array &x, SpanRef<QuadEntry> W,
+                         SpanRef<double> b = {}) {
+  auto *ctx = x.base().ctx;
+  unsigned n = x.nelements();
+  assert((b.empty() || b.size() == n) &&
+         "linear coefficients must match elements of the array!");
+
+  QuadFormData data;
+  for (unsigned i = 0; i != n; ++i) {
+    Expr e = x.ndim() == 0 ? x.base().ref : x.at_offset(i).ref;
+    Variable var = ctx->expr_var(e);
+    assert(var && "quadratic form of non-variables!");
+    data.vars.push_back(var);
+  }
+  for (const auto &entry : W) {
+    assert(entry.i < n && entry.j < n && "index out of bounds!");
+    if (entry.w != 0.0)
+      data.quad.push_back(entry);
+  }
+  for (unsigned i = 0, e = b.size(); i != e; ++i)
+    if (b[i] != 0.0)
+      data.linear.emplace_back(i, b[i]);
+  return Express(ctx, ctx->quad_form(std::move(data)));
+}
+/// Return the quadratic form x^T W x + b^T x of variables \p x with a dense
+/// matrix \p W.
+inline Express quad_form(const Array &x,
+                         const std::vector<std::vector<double>> &W,
+                         SpanRef<double> b = {}) {
+  std::vector<QuadEntry> entries;
+  for (unsigned i = 0, n = W.size(); i != n; ++i)
+    for (unsigned j = 0, m = W[i].size(); j != m; ++j)
+      if (W[i][j] != 0.0)
+        entries.push_back({i, j, W[i][j]});
+  return quad_form(x, entries, b);
+}
 } // namespace cxqubo
 
 namespace std {
@@ -19,8 +19,10 @@
 #include "cxqubo/misc/compare.h"
 #include "cxqubo/misc/debug.h"
 #include "cxqubo/misc/error_handling.h"
-#include "cxqubo/misc/list.h"
 #include "cxqubo/misc/variant.h"
+#include <iterator>
+#include <utility>
+#include <vector>
 
 namespace cxqubo {
 /// Floating point value.
@@ -36,6 +38,8 @@ struct Fp {
 /// Placeholder value.
 struct Placeholder {
   std::string_view name;
+  /// Dense index of the placeholder in Context.
+  unsigned slot = 0;
   friend std::ostream &operator<<(std::ostream &os, Placeholder v) {
     return os << "place('" << v.name << "')";
   }
@@ -114,50 +118,98 @@ struct Unary {
   }
 };
 
+/// Expression raised to a positive integer power.
+struct Pow {
+  Expr base;
+  unsigned exponent = 1;
+
+  friend std::ostream &operator<<(std::ostream &os, const Pow &v) {
+    return os << '(' << v.base << " ^ " << v.exponent << ')';
+  }
+  bool equals(const Pow &rhs) const {
+    return base == rhs.base && exponent == rhs.exponent;
+  }
+};
+
+/// Operands of an n-ary operation. Operands are stored contiguously in
+/// reverse order, i.e. the first operand is the last element of the storage,
+/// so that prepending an operand to a list mostly fills the storage in place.
+/// Lists sharing a storage use its prefixes, which are never modified.
 struct List {
-  using Node = ForwardNode<Expr>;
-  using iterator = ForwardNodeIter<Expr>;
-  using const_iterator = const ForwardNodeIter<Expr>;
+  /// Storage of operands shared by lists. Elements from 'used' to
+  /// 'capacity' are free.
+  struct Storage {
+    Expr *data = nullptr;
+    unsigned capacity = 0;
+    unsigned used = 0;
+  };
+  using iterator = std::reverse_iterator<const Expr *>;
+  using const_iterator = iterator;
 
   Op op = Op::INVALID;
-  Node *node = nullptr;
+  unsigned n = 0;
+  Storage *storage = nullptr;
 
   friend std::ostream &operator<<(std::ostream &os, const List &v) {
-    os << '(' << v.node->value;
-
-    auto *n = v.node->next;
-    while (n) {
-      os << ' ' << v.op << ' ' << n->value;
-      n = n->next;
-    }
+    os << '(' << v.front();
+    for (auto it = std::next(v.begin()); it != v.end(); ++it)
+      os << ' ' << v.op << ' ' << *it;
     return os << ')';
   }
 
   bool equals(const List &rhs) const {
-    return op == rhs.op && node == rhs.node;
+    return op == rhs.op && n == rhs.n && storage == rhs.storage;
   }
 
-  iterator begin() { return iterator(node); }
-  iterator end() { return iterator(); }
+  size_t size() const { return n; }
+  Expr front() const { return storage->data[n - 1]; }
+  Expr operator[](size_t i) const {
+    assert(i < n && "index out of bounds!");
+    return storage->data[n - 1 - i];
+  }
 
-  const_iterator begin() const { return const_iterator(node); }
-  const_iterator end() const { return const_iterator(); }
+  iterator begin() const { return iterator(storage->data + n); }
+  iterator end() const { return iterator(storage->data); }
+};
+
+/// Entry (i, j, w) of a coefficient matrix, i.e. the term w * x_i * x_j.
+struct QuadEntry {
+  unsigned i = 0;
+  unsigned j = 0;
+  double w = 0.0;
+};
+
+/// Terms of a quadratic form x^T W x + b^T x.
+struct QuadFormData {
+  std::vector<Variable> vars;
+  /// Nonzero entries of W, indexing 'vars'.
+  std::vector<QuadEntry> quad;
+  /// Nonzero entries of b as pairs of an index of 'vars' and a coefficient.
+  std::vector<std::pair<unsigned, double>> linear;
+};
+
+/// Quadratic form of variables. Its terms are kept in Context and expanded
+/// directly into polynomials instead of being built as expressions.
+struct QuadForm {
+  /// Index of the data in Context.
+  unsigned index = 0;
+
+  friend std::ostream &operator<<(std::ostream &os, QuadForm v) {
+    return os << "quad_form(" << v.index << ')';
+  }
+  bool equals(QuadForm rhs) const { return index == rhs.index; }
 };
 
 /// Variant of expression.
 using ExprVariant = Variant<std::monostate, Fp, Variable, Placeholder, SubH,
-                            Constraint, Unary, List>;
+                            Constraint, Unary, Pow, List, QuadForm>;
 struct ExprData : public ExprVariant {
   using Super = ExprVariant;
   using Super::Super;
   using Super::operator=;
 
-  ExprData(const ExprData &arg) { *this = arg; }
-  ExprData &operator=(const ExprData &arg) {
-    if (this != &arg)
-      std::visit([this](auto x) { *this = x; }, arg);
-    return *this;
-  }
+  ExprData(const ExprData &) = default;
+  ExprData &operator=(const ExprData &) = default;
 
   struct Drawer {
     std::ostream &os;
@@ -167,7 +219,9 @@ struct ExprData : public ExprVariant {
     std::ostream &operator()(const SubH &v) { return os << v; }
     std::ostream &operator()(const Constraint &v) { return os << v; }
     std::ostream &operator()(const Unary &v) { return os << v; }
+    std::ostream &operator()(const Pow &v) { return os << v; }
     std::ostream &operator()(const List &v) { return os << v; }
+    std::ostream &operator()(const QuadForm &v) { return os << v; }
     std::ostream &operator()(std::monostate) { return os << "<invalid>"; }
   };
   friend std::ostream &operator<<(std::ostream &os, const ExprData &v) {
@@ -16,36 +16,203 @@
 #define CXQUBO_CORE_POLYNOMIAL_H
 
 #include "cxqubo/core/context.h"
+#include "cxqubo/misc/allocator.h"
 #include "cxqubo/misc/debug.h"
 #include "cxqubo/misc/error_handling.h"
-#include <unordered_map>
+#include "cxqubo/misc/flatmap.h"
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <vector>
 
 namespace cxqubo {
+/// Arithmetic of polynomial coefficients. A coefficient is an affine form when
+/// it may include placeholders, otherwise a plain number.
+template <class C> struct CoeffTraits;
+
+template <> struct CoeffTraits<double> {
+  static double number(Context &ctx, double v) { return v; }
+  static double fp(Context &ctx, Fp v, Expr expr) { return v.value; }
+  static double placeholder(Context &ctx, Placeholder v, Expr expr) {
+    unreachable_code("placeholder in numeric coefficient is not allowed!");
+  }
+
+  static double add(Context &ctx, double lhs, double rhs) { return lhs + rhs; }
+  static double mul(Context &ctx, double lhs, double rhs) { return lhs * rhs; }
+  static double neg(Context &ctx, double v) { return -v; }
+};
+
+/// Coefficient in affine form of placeholders,
+///   constant + c_0 * p_0 + c_1 * p_1 + ... + rest,
+/// where p_i is a placeholder identified by its slot. Products of placeholders
+/// such as 'A * B' cannot be represented in this form, so they are kept in
+/// \p rest as an expression.
+struct AffineCoeff {
+  double constant = 0.0;
+  /// Pairs of placeholder slot and coefficient, sorted by slot.
+  std::vector<std::pair<unsigned, double>> linear;
+  Expr rest;
+
+public:
+  AffineCoeff() = default;
+  AffineCoeff(double constant) : constant(constant) {}
+
+  static inline AffineCoeff placeholder(unsigned slot, double coeff = 1.0) {
+    AffineCoeff result;
+    result.linear.emplace_back(slot, coeff);
+    return result;
+  }
+
+  /// Return true if the coefficient has no placeholders.
+  bool is_number() const { return linear.empty() && !rest; }
+
+  bool equals(const AffineCoeff &rhs) const {
+    return constant == rhs.constant && linear == rhs.linear &&
+           rest == rhs.rest;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const AffineCoeff &v) {
+    os << "affine(" << std::to_string(v.constant);
+    for (auto [slot, coeff] : v.linear)
+      os << " + " << std::to_string(coeff) << " * $" << slot;
+    if (v.rest)
+      os << " + " << v.rest;
+    return os << ')';
+  }
+};
+
+template <> struct CoeffTraits<AffineCoeff> {
+  static AffineCoeff number(Context &ctx, double v) { return v; }
+  static AffineCoeff fp(Context &ctx, Fp v, Expr expr) { return v.value; }
+  static AffineCoeff placeholder(Context &ctx, Placeholder v, Expr expr) {
+    return AffineCoeff::placeholder(v.slot);
+  }
+
+  static AffineCoeff add(Context &ctx, const AffineCoeff &lhs,
+                         const AffineCoeff &rhs) {
+    AffineCoeff result(lhs.constant + rhs.constant);
+
+    // Merge sorted slots.
+    auto lit = lhs.linear.begin(), lend = lhs.linear.end();
+    auto rit = rhs.linear.begin(), rend = rhs.linear.end();
+    result.linear.reserve(lhs.linear.size() + rhs.linear.size());
+    while (lit != lend && rit != rend) {
+      if (lit->first < rit->first) {
+        result.linear.push_back(*lit++);
+      } else if (rit->first < lit->first) {
+        result.linear.push_back(*rit++);
+      } else {
+        double v = lit->second + rit->second;
+        if (v != 0.0)
+          result.linear.emplace_back(lit->first, v);
+        ++lit;
+        ++rit;
+      }
+    }
+    result.linear.insert(result.linear.end(), lit, lend);
+    result.linear.insert(result.linear.end(), rit, rend);
+
+    if (lhs.rest && rhs.rest)
+      result.rest = ctx.add(lhs.rest, rhs.rest);
+    else
+      result.rest = lhs.rest ? lhs.rest : rhs.rest;
+    return result;
+  }
+  static AffineCoeff mul(Context &ctx, const AffineCoeff &lhs,
+                         const AffineCoeff &rhs) {
+    if (lhs.is_number())
+      return scale(ctx, rhs, lhs.constant);
+    if (rhs.is_number())
+      return scale(ctx, lhs, rhs.constant);
+
+    // Not affine any more.
+    AffineCoeff result;
+    result.rest = ctx.mul(as_expr(ctx, lhs), as_expr(ctx, rhs));
+    return result;
+  }
+  static AffineCoeff neg(Context &ctx, const AffineCoeff &v) {
+    return scale(ctx, v, -1.0);
+  }
+
+  static AffineCoeff scale(Context &ctx, const AffineCoeff &v, double factor) {
+    if (factor == 0.0)
+      return AffineCoeff();
+
+    AffineCoeff result(v);
+    result.constant *= factor;
+    for (auto &[slot, coeff] : result.linear)
+      coeff *= factor;
+    if (result.rest)
+      result.rest = ctx.mul(ctx.fp(factor), result.rest);
+    return result;
+  }
+
+  /// Convert to an expression.
+  static Expr as_expr(Context &ctx, const AffineCoeff &v) {
+    Expr result = ctx.fp(v.constant);
+    for (auto [slot, coeff] : v.linear)
+      result =
+          ctx.add(result, ctx.mul(ctx.fp(coeff), ctx.placeholder_of(slot)));
+    return v.rest ? ctx.add(result, v.rest) : result;
+  }
+};
+
 /// A polynomial with multiple terms.
-using Multi = std::unordered_map<Product, Expr>;
+template <class C> using BasicMulti = FlatMap<Product, C>;
 /// A polynomial with a single term.
-using Single = std::pair<Product, Expr>;
+template <class C> using BasicSingle = std::pair<Product, C>;
+
+/// A polynomial of degree at most one, k + c_0 * x_0 + c_1 * x_1 + ...
+/// Terms are appended without product lookups and merged lazily, so sums of
+/// variables are built without hashing.
+template <class C> struct BasicLinear {
+  using Terms = std::vector<std::pair<Variable, C>>;
+
+  /// Pairs of variable and coefficient.
+  Terms terms;
+  std::optional<C> constant;
+  /// True if terms are sorted by variable without duplicates.
+  bool normalized = true;
+
+  /// Number of terms. It may include duplicates if not normalized.
+  size_t size() const { return terms.size() + (constant ? 1 : 0); }
+
+  friend std::ostream &operator<<(std::ostream &os, const BasicLinear &v) {
+    os << "linear(";
+    if (v.constant)
+      os << *v.constant;
+    for (const auto &[var, coeff] : v.terms)
+      os << " + " << coeff << " * " << var;
+    return os << ')';
+  }
+};
+
+template <class C> class ConstPolyIter {
+  using Multi = BasicMulti<C>;
+  using Single = BasicSingle<C>;
 
-class ConstPolyIter {
-  Variant<std::monostate, Single, Multi::const_iterator> iter;
-  Multi::const_iterator end;
+  Variant<std::monostate, Single, typename Multi::const_iterator> iter;
+  typename Multi::const_iterator end;
 
 public:
   ConstPolyIter() = default;
   ConstPolyIter(Single single) : iter(single) {}
-  ConstPolyIter(Multi::const_iterator it, Multi::const_iterator end)
-      : iter(it), end(end) {}
-
-  bool equals(const ConstPolyIter &rhs) const {
-    return iter == rhs.iter && end == rhs.end;
+  ConstPolyIter(typename Multi::const_iterator it,
+                typename Multi::const_iterator end)
+      : iter(it), end(end) {
+    if (it == end)
+      iter = std::monostate();
   }
 
-  std::pair<Product, Expr> operator*() const {
+  /// Exhausted iterators are equal regardless of the poly they came from.
+  bool equals(const ConstPolyIter &rhs) const { return iter == rhs.iter; }
+
+  std::pair<Product, C> operator*() const {
     assert(!iter.empty() && "index out of bounds!");
-    if (auto *p = iter.as_ptr_if<Single>())
+    if (auto *p = iter.template as_ptr_if<Single>())
       return *p;
     else
-      return *iter.as<Multi::const_iterator>();
+      return *iter.template as<typename Multi::const_iterator>();
   }
 
   ConstPolyIter &operator++() {
@@ -60,159 +227,361 @@ public:
   }
 
 private:
-  void advance();
+  void advance() {
+    assert(!iter.empty() && "index out of bounds!");
+
+    if (iter.template is<Single>())
+      iter = std::monostate();
+    else {
+      auto it = ++iter.template as<typename Multi::const_iterator>();
+      if (it == end)
+        iter = std::monostate();
+    }
+  }
 };
 
-class Poly : public Variant<std::monostate, Single, Multi> {
-  using Super = Variant<std::monostate, Single, Multi>;
+/// A polynomial. BasicLinear is only used while parsing, and is converted
+/// to Single or Multi by BasicPolyBuilder::finalize.
+template <class C>
+class BasicPoly : public Variant<std::monostate, BasicSingle<C>,
+                                 BasicMulti<C>, BasicLinear<C>> {
+  using Super =
+      Variant<std::monostate, BasicSingle<C>, BasicMulti<C>, BasicLinear<C>>;
 
 public:
+  using Coeff = C;
+  using Multi = BasicMulti<C>;
+  using Single = BasicSingle<C>;
+  using Linear = BasicLinear<C>;
+
   using Super::Super;
   using Super::operator=;
 
   static inline Product term_none() { return Product::none(); }
 
-  bool is_empty() const { return is<std::monostate>(); }
-  bool is_single() const { return is<Single>(); }
-  bool is_multi() const { return is<Multi>(); }
+  bool is_empty() const { return this->template is<std::monostate>(); }
+  bool is_single() const { return this->template is<Single>(); }
+  bool is_multi() const { return this->template is<Multi>(); }
+  bool is_linear() const { return this->template is<Linear>(); }
 
   size_t size() const {
     if (is_empty())
       return 0;
     else if (is_single())
       return 1;
-    return as<Multi>().size();
+    else if (is_linear())
+      return this->template as<Linear>().size();
+    return this->template as<Multi>().size();
   }
 
-  ConstPolyIter begin() const {
-    if (auto *p = as_ptr_if<Single>())
+  ConstPolyIter<C> begin() const {
+    assert(!is_linear() && "linear poly must be finalized!");
+    if (auto *p = this->template as_ptr_if<Single>())
       return *p;
-    if (auto *p = as_ptr_if<Multi>())
-      return ConstPolyIter(p->begin(), p->end());
+    if (auto *p = this->template as_ptr_if<Multi>())
+      return ConstPolyIter<C>(p->begin(), p->end());
 
-    return ConstPolyIter();
+    return ConstPolyIter<C>();
   }
 
-  ConstPolyIter end() const { return ConstPolyIter(); }
+  ConstPolyIter<C> end() const { return ConstPolyIter<C>(); }
 
-  friend std::ostream &operator<<(std::ostream &os, const Poly &v) {
-    if (const auto *p = v.as_ptr_if<Single>())
+  friend std::ostream &operator<<(std::ostream &os, const BasicPoly &v) {
+    if (const auto *p = v.template as_ptr_if<Single>())
       return os << '{' << p->first << ", " << p->second << '}';
-    if (const auto *p = v.as_ptr_if<Multi>())
+    if (const auto *p = v.template as_ptr_if<Multi>())
+      return os << *p;
+    if (const auto *p = v.template as_ptr_if<Linear>())
       return os << *p;
     return os << "<none>";
   }
 
 public:
   void clear() { *this = std::monostate(); }
-  void insert_or_add(Context &ctx, Product term, Expr coeff) {
+  void insert_or_add(Context &ctx, Product term, C coeff) {
+    assert(!is_linear() && "linear poly must be finalized!");
     // Single.
-    if (auto *p = as_ptr_if<Single>()) {
+    if (auto *p = this->template as_ptr_if<Single>()) {
       if (p->first == term) {
-        p->second = ctx.add(p->second, coeff);
+        p->second = CoeffTraits<C>::add(ctx, p->second, coeff);
       } else {
-        *this = Multi{as<Single>(), {term, coeff}};
+        *this = Multi{*p, {term, coeff}};
       }
-    } else if (auto *p = as_ptr_if<Multi>()) {
+    } else if (auto *p = this->template as_ptr_if<Multi>()) {
       auto [it, inserted] = p->emplace(term, coeff);
       if (!inserted)
-        it->second = ctx.add(it->second, coeff);
+        it->second = CoeffTraits<C>::add(ctx, it->second, coeff);
     } else {
       *this = Single{term, coeff};
     }
   }
 };
 
-inline void ConstPolyIter::advance() {
-  assert(!iter.empty() && "index out of bounds!");
+/// A polynomial whose coefficients are plain numbers.
+using NumPoly = BasicPoly<double>;
+/// A polynomial whose coefficients are affine forms of placeholders.
+using AffinePoly = BasicPoly<AffineCoeff>;
 
-  if (iter.is<Single>())
-    iter = std::monostate();
-  else {
-    auto it = ++iter.as<Multi::const_iterator>();
-    if (it == end)
-      iter = std::monostate();
-  }
-}
+/// Generator of polynomial expressions. Storage of consumed polys is pooled
+/// and reused for later results.
+template <class C> struct BasicPolyBuilder {
+  using Poly = BasicPoly<C>;
+  using Multi = BasicMulti<C>;
+  using Single = BasicSingle<C>;
+  using Linear = BasicLinear<C>;
+  using Traits = CoeffTraits<C>;
 
-/// Generator of polynomial expressions.
-/// TODO: Implement and use memory recycler for Poly.
-struct PolyBuilder {
   Context *ctx = nullptr;
+  /// Domain of variables in products. Variables of the other type are
+  /// rewritten into it.
+  Vartype domain = Vartype::BINARY;
+  Recycler<Multi> multis;
+  Recycler<typename Linear::Terms> linear_terms;
 
 public:
-  PolyBuilder(Context &ctx) : ctx(&ctx) {}
+  BasicPolyBuilder(Context &ctx, Vartype domain = Vartype::BINARY)
+      : ctx(&ctx), domain(domain) {}
+
+  /// Take over the storage of \p poly for later results and clear it.
+  void recycle(Poly &&poly) {
+    if (auto *p = poly.template as_ptr_if<Multi>())
+      multis.recycle(std::move(*p));
+    else if (auto *p = poly.template as_ptr_if<Linear>())
+      linear_terms.recycle(std::move(p->terms));
+    poly.clear();
+  }
 
 public:
   bool is_constant(const Poly &poly) const {
-    return poly.is_single() && !poly.as<Single>().first;
+    return poly.is_single() && is_constant(poly.template as<Single>());
   }
+  bool is_constant(const Single &single) const { return !single.first; }
 
   bool is_a_variable(const Poly &poly) const {
-    return poly.is_single() && ctx->dim_of(poly.as<Single>().first) == 1;
+    return poly.is_single() &&
+           ctx->dim_of(poly.template as<Single>().first) == 1;
   }
 
-  Expr constant_value(const Poly &poly) const {
-    return is_constant(poly) ? poly.as<Single>().second : Expr::none();
+  C constant_value(const Poly &poly) const {
+    return is_constant(poly) ? poly.template as<Single>().second : C();
   }
 
   Variable a_variable(const Poly &poly) const {
-    return is_a_variable(poly) ? ctx->product_data(poly.as<Single>().first)[0]
-                               : Variable::none();
+    return is_a_variable(poly)
+               ? ctx->product_data(poly.template as<Single>().first)[0]
+               : Variable::none();
   }
 
 public:
   Poly variable(Variable var) {
-    auto term = ctx->save_product({var}, true);
-    auto type = ctx->var_data(var).type;
-    if (type == Vartype::SPIN) {
-      return Multi{{term, ctx->fp(2.0)}, {Poly::term_none(), ctx->fp(-1)}};
+    auto type = ctx->var_type(var);
+    Linear result = new_linear();
+    if (type == domain) {
+      result.terms.emplace_back(var, Traits::number(*ctx, 1.0));
+      return result;
+    } else if (type == Vartype::SPIN) {
+      // s = 2x - 1
+      result.terms.emplace_back(var, Traits::number(*ctx, 2.0));
+      result.constant = Traits::number(*ctx, -1.0);
+      return result;
     } else if (type == Vartype::BINARY) {
-      return Single{term, ctx->fp(1.0)};
+      // x = (s + 1) / 2
+      result.terms.emplace_back(var, Traits::number(*ctx, 0.5));
+      result.constant = Traits::number(*ctx, 0.5);
+      return result;
     }
     unreachable_code("unsupported variable type!");
   }
 
-  Poly constant(Expr coeff) const { return Single{Poly::term_none(), coeff}; }
+  Poly constant(C coeff) const { return Single{Poly::term_none(), coeff}; }
+
+  /// Return the polynomial of the quadratic form \p data, whose variables
+  /// must be in the domain.
+  Poly quad_form(const QuadFormData &data) {
+    const auto &vars = data.vars;
+    Multi result = new_multi(data.quad.size() + data.linear.size());
+    for (auto [i, j, w] : data.quad)
+      insert_or_add(*ctx, result, mul_vars(vars[i], vars[j]),
+                    Traits::number(*ctx, w));
+    for (auto [i, b] : data.linear)
+      insert_or_add(*ctx, result, ctx->save_product({vars[i]}, true),
+                    Traits::number(*ctx, b));
+    if (result.empty()) {
+      multis.recycle(std::move(result));
+      return constant(Traits::number(*ctx, 0.0));
+    }
+    return shrink(std::move(result));
+  }
 
-  void neg_assign(Poly &poly) const {
-    if (auto *p = poly.as_ptr_if<Single>()) {
-      p->second = ctx->neg(p->second);
+  /// Convert a linear poly to Single or Multi.
+  void finalize(Poly &poly) {
+    auto *p = poly.template as_ptr_if<Linear>();
+    if (!p)
+      return;
+
+    normalize(*p);
+    if (p->size() != 1) {
+      replace(poly, to_multi(*p));
+    } else if (p->constant) {
+      replace(poly, constant(*p->constant));
+    } else {
+      auto [var, coeff] = p->terms[0];
+      replace(poly, Single{ctx->save_product({var}, true), coeff});
+    }
+  }
+
+  void neg_assign(Poly &poly) {
+    if (auto *p = poly.template as_ptr_if<Single>()) {
+      p->second = Traits::neg(*ctx, p->second);
       return;
     }
 
-    if (auto *p = poly.as_ptr_if<Multi>()) {
+    if (auto *p = poly.template as_ptr_if<Multi>()) {
       for (auto &[term, coeff] : *p)
-        coeff = ctx->neg(coeff);
+        coeff = Traits::neg(*ctx, coeff);
+    }
+
+    if (auto *p = poly.template as_ptr_if<Linear>()) {
+      normalize(*p);
+      for (auto &[var, coeff] : p->terms)
+        coeff = Traits::neg(*ctx, coeff);
+      if (p->constant)
+        p->constant = Traits::neg(*ctx, *p->constant);
     }
   }
-  void add_assign(Poly &lhs, const Poly &rhs) const {
-    if (auto *p = rhs.as_ptr_if<Single>()) {
+  /// Add \p rhs to \p lhs. The larger storage of the two is kept.
+  void add_assign(Poly &lhs, Poly &&rhs) {
+    if (rhs.size() > lhs.size())
+      std::swap(lhs, rhs);
+    add_assign(lhs, std::as_const(rhs));
+    recycle(std::move(rhs));
+  }
+  void add_assign(Poly &lhs, const Poly &rhs) {
+    if (lhs.is_linear() || rhs.is_linear()) {
+      if (is_linear_or_constant(lhs) && is_linear_or_constant(rhs)) {
+        if (!lhs.is_linear())
+          lhs = as_linear(lhs);
+        append(lhs.template as<Linear>(), rhs);
+        return;
+      }
+
+      // Degree is raised.
+      if (auto *p = lhs.template as_ptr_if<Linear>()) {
+        normalize(*p);
+        replace(lhs, to_multi(*p));
+      }
+      if (auto *p = rhs.template as_ptr_if<Linear>()) {
+        normalize_copy(*p, [&](const Linear &v) {
+          for (const auto &[var, coeff] : v.terms)
+            lhs.insert_or_add(*ctx, ctx->save_product({var}, true), coeff);
+          if (v.constant)
+            lhs.insert_or_add(*ctx, Poly::term_none(), *v.constant);
+        });
+        return;
+      }
+    }
+
+    if (auto *p = rhs.template as_ptr_if<Single>()) {
       lhs.insert_or_add(*ctx, p->first, p->second);
     } else {
-      for (auto [term, coeff] : rhs.as<Multi>())
+      for (const auto &[term, coeff] : rhs.template as<Multi>())
         lhs.insert_or_add(*ctx, term, coeff);
     }
   }
+  /// Multiply \p lhs by \p rhs. A constant factor is applied in place.
+  void mul_assign(Poly &lhs, Poly &&rhs) {
+    if (is_constant(lhs) && !is_constant(rhs))
+      std::swap(lhs, rhs);
+    mul_assign(lhs, std::as_const(rhs));
+    recycle(std::move(rhs));
+  }
   void mul_assign(Poly &lhs, const Poly &rhs) {
-    if (const auto *lp = lhs.as_ptr_if<Single>()) {
-      if (const auto *rp = rhs.as_ptr_if<Single>())
+    if (auto *lp = lhs.template as_ptr_if<Linear>()) {
+      if (is_constant(rhs)) {
+        scale(*lp, rhs.template as<Single>().second);
+        return;
+      }
+      if (const auto *rp = rhs.template as_ptr_if<Linear>()) {
+        normalize(*lp);
+        normalize_copy(*rp, [&](const Linear &r) {
+          replace(lhs, mul_linear_linear(lhs.template as<Linear>(), r));
+        });
+        return;
+      }
+      normalize(*lp);
+      replace(lhs, to_multi(*lp));
+    } else if (const auto *rp = rhs.template as_ptr_if<Linear>()) {
+      if (is_constant(lhs)) {
+        C coeff = lhs.template as<Single>().second;
+        lhs = copy(rhs);
+        scale(lhs.template as<Linear>(), coeff);
+        return;
+      }
+      normalize_copy(*rp,
+                     [&](const Linear &r) { mul_assign(lhs, to_multi(r)); });
+      return;
+    }
+
+    if (const auto *lp = lhs.template as_ptr_if<Single>()) {
+      if (const auto *rp = rhs.template as_ptr_if<Single>())
         lhs = mul_single_single(*lp, *rp);
-      else if (const auto *rp = rhs.as_ptr_if<Multi>())
+      else if (const auto *rp = rhs.template as_ptr_if<Multi>())
         lhs = mul_multi_single(*rp, *lp);
       else
         unreachable_code("unable to multiply polys");
-    } else if (const auto *rp = rhs.as_ptr_if<Single>()) {
-      lhs = mul_multi_single(lhs.as<Multi>(), *rp);
+    } else if (const auto *rp = rhs.template as_ptr_if<Single>()) {
+      auto &multi = lhs.template as<Multi>();
+      if (is_constant(*rp)) {
+        for (auto &[term, coeff] : multi)
+          coeff = Traits::mul(*ctx, coeff, rp->second);
+      } else {
+        replace(lhs, mul_multi_single(multi, *rp));
+      }
     } else {
-      lhs = mul_multi_multi(lhs.as<Multi>(), rhs.as<Multi>());
+      replace(lhs, mul_multi_multi(lhs.template as<Multi>(),
+                                   rhs.template as<Multi>()));
+    }
+  }
+
+  /// Raise \p poly to the power of \p exponent by repeated squaring.
+  void pow_assign(Poly &poly, unsigned exponent) {
+    assert(exponent > 0 && "exponent should be positive!");
+    if (exponent == 1)
+      return;
+
+    if (auto *p = poly.template as_ptr_if<Single>()) {
+      auto single = *p;
+      while (--exponent > 0)
+        single = mul_single_single(single, *p).template as<Single>();
+      poly = single;
+      return;
     }
+
+    Poly base = std::move(poly);
+    poly.clear();
+    while (true) {
+      if (exponent & 1) {
+        if (poly.is_empty())
+          poly = copy(base);
+        else
+          mul_assign(poly, base);
+      }
+      exponent >>= 1;
+      if (exponent == 0)
+        break;
+      replace(base, square(base));
+    }
+    recycle(std::move(base));
   }
 
 private:
+  Product mul_vars(Variable lhs, Variable rhs) {
+    return ctx->mul_vars(lhs, rhs, domain);
+  }
+
   inline Product mul_terms(Product lhs, Product rhs) {
     if (lhs && rhs)
-      return ctx->mul_products(lhs, rhs);
+      return ctx->mul_products(lhs, rhs, domain);
     else if (lhs)
       return lhs;
     else if (rhs)
@@ -223,32 +592,248 @@ private:
 
   Poly mul_single_single(const Single &lhs, const Single &rhs) {
     return Single{mul_terms(lhs.first, rhs.first),
-                  ctx->mul(lhs.second, rhs.second)};
+                  Traits::mul(*ctx, lhs.second, rhs.second)};
   }
 
   Poly mul_multi_single(const Multi &lhs, const Single &rhs) {
-    Poly result;
-    if (is_constant(rhs)) {
-      result = lhs;
-      for (auto &[term, coeff] : result.as<Multi>())
-        coeff = ctx->mul(coeff, rhs.second);
+    Multi result = new_multi(lhs.size());
+    for (const auto &[lterm, lcoeff] : lhs)
+      insert_or_add(*ctx, result, mul_terms(lterm, rhs.first),
+                    Traits::mul(*ctx, lcoeff, rhs.second));
+    return shrink(std::move(result));
+  }
+
+  Poly mul_multi_multi(const Multi &lhs, const Multi &rhs) {
+    Multi result = new_multi(std::max(lhs.size(), rhs.size()));
+    for (const auto &[lterm, lcoeff] : lhs)
+      for (const auto &[rterm, rcoeff] : rhs)
+        insert_or_add(*ctx, result, mul_terms(lterm, rterm),
+                      Traits::mul(*ctx, lcoeff, rcoeff));
+    return shrink(std::move(result));
+  }
+
+  /// Square \p poly. Cross terms are computed once for each unordered pair.
+  Poly square(const Poly &poly) {
+    if (const auto *p = poly.template as_ptr_if<Single>())
+      return mul_single_single(*p, *p);
+    if (const auto *p = poly.template as_ptr_if<Linear>()) {
+      Poly result;
+      normalize_copy(*p, [&](const Linear &v) { result = square_linear(v); });
       return result;
-    } else {
-      for (auto [lterm, lcoeff] : lhs)
-        result.insert_or_add(*ctx, mul_terms(lterm, rhs.first),
-                             ctx->mul(lcoeff, rhs.second));
+    }
+
+    const auto &multi = poly.template as<Multi>();
+    Multi result = new_multi(multi.size());
+    for (auto lit = multi.begin(), end = multi.end(); lit != end; ++lit) {
+      const auto &[lterm, lcoeff] = *lit;
+      insert_or_add(*ctx, result, mul_terms(lterm, lterm),
+                    Traits::mul(*ctx, lcoeff, lcoeff));
+      for (auto rit = std::next(lit); rit != end; ++rit) {
+        const auto &[rterm, rcoeff] = *rit;
+        auto coeff = Traits::mul(*ctx, lcoeff, rcoeff);
+        insert_or_add(*ctx, result, mul_terms(lterm, rterm),
+                      Traits::add(*ctx, coeff, coeff));
+      }
+    }
+    return shrink(std::move(result));
+  }
+
+private:
+  Multi new_multi(size_t n) {
+    Multi result = multis.acquire();
+    result.reserve(n);
+    return result;
+  }
+
+  Linear new_linear() {
+    Linear result;
+    result.terms = linear_terms.acquire();
+    return result;
+  }
+
+  /// Copy \p poly into pooled storage.
+  Poly copy(const Poly &poly) {
+    if (const auto *p = poly.template as_ptr_if<Multi>()) {
+      Multi result = new_multi(p->size());
+      for (const auto &[term, coeff] : *p)
+        result.emplace(term, coeff);
       return result;
     }
+    if (const auto *p = poly.template as_ptr_if<Linear>()) {
+      Linear result = new_linear();
+      result.terms.assign(p->terms.begin(), p->terms.end());
+      result.constant = p->constant;
+      result.normalized = p->normalized;
+      return result;
+    }
+    return poly;
   }
 
-  Poly mul_multi_multi(const Multi &lhs, const Multi &rhs) {
-    Poly result;
-    for (auto [lterm, lcoeff] : lhs)
-      for (auto [rterm, rcoeff] : rhs)
-        result.insert_or_add(*ctx, mul_terms(lterm, rterm),
-                             ctx->mul(lcoeff, rcoeff));
+  /// Replace \p poly with \p result, recycling the storage of \p poly.
+  void replace(Poly &poly, Poly &&result) {
+    recycle(std::move(poly));
+    poly = std::move(result);
+  }
+
+  bool is_linear_or_constant(const Poly &poly) const {
+    return poly.is_linear() || is_constant(poly);
+  }
+
+  /// Convert a constant poly to linear.
+  Linear as_linear(const Poly &poly) {
+    Linear result = new_linear();
+    result.constant = poly.template as<Single>().second;
     return result;
   }
+
+  /// Append \p rhs, which must be linear or constant, to \p lhs.
+  void append(Linear &lhs, const Poly &rhs) const {
+    std::optional<C> constant;
+    if (const auto *p = rhs.template as_ptr_if<Linear>()) {
+      if (!p->terms.empty()) {
+        lhs.normalized = lhs.terms.empty() && p->normalized;
+        lhs.terms.insert(lhs.terms.end(), p->terms.begin(), p->terms.end());
+      }
+      constant = p->constant;
+    } else {
+      constant = rhs.template as<Single>().second;
+    }
+
+    if (constant)
+      lhs.constant = lhs.constant ? Traits::add(*ctx, *lhs.constant, *constant)
+                                  : *constant;
+  }
+
+  /// Sort terms by variable and merge duplicates.
+  void normalize(Linear &v) const {
+    if (v.normalized)
+      return;
+
+    auto &terms = v.terms;
+    std::stable_sort(
+        terms.begin(), terms.end(),
+        [](const auto &l, const auto &r) { return l.first < r.first; });
+
+    size_t n = 0;
+    for (size_t i = 0, e = terms.size(); i != e; ++i) {
+      if (n != 0 && terms[n - 1].first == terms[i].first)
+        terms[n - 1].second =
+            Traits::add(*ctx, terms[n - 1].second, terms[i].second);
+      else if (n++ != i)
+        terms[n - 1] = std::move(terms[i]);
+    }
+    terms.resize(n);
+    v.normalized = true;
+  }
+
+  /// Call \p fn with a normalized \p v, copying it only if necessary.
+  template <class Fn> void normalize_copy(const Linear &v, Fn fn) const {
+    if (v.normalized)
+      return fn(v);
+
+    Linear tmp = v;
+    normalize(tmp);
+    fn(tmp);
+  }
+
+  void scale(Linear &v, const C &factor) const {
+    // Merge duplicates first not to scale them repeatedly.
+    normalize(v);
+    for (auto &[var, coeff] : v.terms)
+      coeff = Traits::mul(*ctx, coeff, factor);
+    if (v.constant)
+      v.constant = Traits::mul(*ctx, *v.constant, factor);
+  }
+
+  /// Convert a normalized linear poly to Multi.
+  Poly to_multi(const Linear &v) {
+    assert(v.normalized && "linear poly must be normalized!");
+    Multi result = new_multi(v.size());
+    for (const auto &[var, coeff] : v.terms)
+      result.emplace(ctx->save_product({var}, true), coeff);
+    if (v.constant)
+      result.emplace(Poly::term_none(), *v.constant);
+    return result;
+  }
+
+  static void insert_or_add(Context &ctx, Multi &multi, Product term,
+                            C coeff) {
+    auto [it, inserted] = multi.emplace(term, coeff);
+    if (!inserted)
+      it->second = Traits::add(ctx, it->second, coeff);
+  }
+
+  static Poly shrink(Multi &&multi) {
+    if (multi.size() == 1)
+      return *multi.begin();
+    return std::move(multi);
+  }
+
+  /// Multiply normalized linear polys.
+  Poly mul_linear_linear(const Linear &lhs, const Linear &rhs) {
+    if (lhs.size() == 1 && rhs.size() == 1 && !lhs.constant && !rhs.constant)
+      return Single{mul_vars(lhs.terms[0].first, rhs.terms[0].first),
+                    Traits::mul(*ctx, lhs.terms[0].second,
+                                rhs.terms[0].second)};
+
+    Multi result = new_multi(lhs.size() * rhs.size());
+    for (const auto &[lvar, lcoeff] : lhs.terms) {
+      for (const auto &[rvar, rcoeff] : rhs.terms)
+        insert_or_add(*ctx, result, mul_vars(lvar, rvar),
+                      Traits::mul(*ctx, lcoeff, rcoeff));
+      if (rhs.constant)
+        insert_or_add(*ctx, result, ctx->save_product({lvar}, true),
+                      Traits::mul(*ctx, lcoeff, *rhs.constant));
+    }
+
+    if (lhs.constant) {
+      for (const auto &[rvar, rcoeff] : rhs.terms)
+        insert_or_add(*ctx, result, ctx->save_product({rvar}, true),
+                      Traits::mul(*ctx, *lhs.constant, rcoeff));
+      if (rhs.constant)
+        insert_or_add(*ctx, result, Poly::term_none(),
+                      Traits::mul(*ctx, *lhs.constant, *rhs.constant));
+    }
+    return shrink(std::move(result));
+  }
+
+  /// Square a normalized linear poly. All generated terms are distinct.
+  Poly square_linear(const Linear &v) {
+    Multi result = new_multi(v.size() * (v.size() + 1) / 2);
+    std::optional<C> constant;
+    if (v.constant)
+      constant = Traits::mul(*ctx, *v.constant, *v.constant);
+
+    const auto &terms = v.terms;
+    for (size_t i = 0, n = terms.size(); i != n; ++i) {
+      const auto &[lvar, lcoeff] = terms[i];
+      // (c x)^2 is c^2 x for binary and c^2 for spin. It is merged with the
+      // cross term of the constant.
+      std::optional<C> diag;
+      auto square = Traits::mul(*ctx, lcoeff, lcoeff);
+      if (domain == Vartype::SPIN)
+        constant = constant ? Traits::add(*ctx, *constant, square) : square;
+      else
+        diag = square;
+      if (v.constant) {
+        auto c = Traits::mul(*ctx, lcoeff, *v.constant);
+        c = Traits::add(*ctx, c, c);
+        diag = diag ? Traits::add(*ctx, *diag, c) : c;
+      }
+      if (diag)
+        result.emplace(ctx->save_product(lvar, true), *diag);
+
+      for (size_t j = i + 1; j != n; ++j) {
+        const auto &[rvar, rcoeff] = terms[j];
+        auto coeff = Traits::mul(*ctx, lcoeff, rcoeff);
+        result.emplace(mul_vars(lvar, rvar), Traits::add(*ctx, coeff, coeff));
+      }
+    }
+
+    if (constant)
+      result.emplace(Poly::term_none(), *constant);
+    return shrink(std::move(result));
+  }
 };
 } // namespace cxqubo
 
@@ -23,36 +23,78 @@
 #include "cxqubo/misc/spanref.h"
 
 namespace cxqubo {
-class ProductData : public SpanRef<Variable> {
+/// Variables of a product saved in the arena of a context. Saved products
+/// have more than two variables, so only the span is kept.
+class ProductSpan : public SpanRef<Variable> {
   using Super = SpanRef<Variable>;
 
 public:
-  ProductData() = default;
-  ProductData(const SpanRef<Variable> &arg) : Super(arg) {}
-  ProductData &operator=(const SpanRef<Variable> &arg) {
-    static_cast<Super &>(*this) = arg;
-    return *this;
-  }
+  ProductSpan() = default;
+  ProductSpan(const SpanRef<Variable> &arg) : Super(arg) {}
 
   size_t hash() const { return hash_range(begin(), end()); }
 
-  friend std::ostream &operator<<(std::ostream &os, const ProductData &v) {
+  friend std::ostream &operator<<(std::ostream &os, const ProductSpan &v) {
     os << '(';
     draw_range(os, v);
     return os << ')';
   }
 
-  int compare(const ProductData &rhs) const {
+  int compare(const ProductSpan &rhs) const {
     return compare_range(*this, rhs);
   }
 };
 
-inline size_t hash_value(ProductData product) { return product.hash(); }
+/// Variables of a product. Variables of an inline product are copied into
+/// the object itself, so it must outlive spans taken from it.
+class ProductData : public ProductSpan {
+  using Super = ProductSpan;
+
+  Variable vars[2];
+
+public:
+  ProductData() = default;
+  ProductData(const SpanRef<Variable> &arg) : Super(arg) {}
+  explicit ProductData(Product p)
+      : Super(SpanRef<Variable>(vars, p.second() ? 2 : 1)),
+        vars{p.first(), p.second()} {
+    assert(p.is_inline() && "product must be inline!");
+  }
+  ProductData(const ProductData &arg)
+      : Super(arg), vars{arg.vars[0], arg.vars[1]} {
+    rebase(arg);
+  }
+  ProductData &operator=(const ProductData &arg) {
+    static_cast<Super &>(*this) = arg;
+    vars[0] = arg.vars[0];
+    vars[1] = arg.vars[1];
+    rebase(arg);
+    return *this;
+  }
+  ProductData &operator=(const SpanRef<Variable> &arg) {
+    static_cast<Super &>(*this) = arg;
+    return *this;
+  }
+
+private:
+  /// Point to our own copy if \p arg points to its inline variables.
+  void rebase(const ProductData &arg) {
+    if (arg.data() == arg.vars)
+      static_cast<Super &>(*this) = SpanRef<Variable>(vars, arg.size());
+  }
+};
+
+inline size_t hash_value(ProductSpan product) { return product.hash(); }
 } // namespace cxqubo
 
 namespace std {
+template <> struct hash<cxqubo::ProductSpan> {
+  auto operator()(cxqubo::ProductSpan v) const noexcept { return v.hash(); }
+};
 template <> struct hash<cxqubo::ProductData> {
-  auto operator()(cxqubo::ProductData v) const noexcept { return v.hash(); }
+  auto operator()(const cxqubo::ProductData &v) const noexcept {
+    return v.hash();
+  }
 };
 } // namespace std
 
@@ -17,6 +17,10 @@
 
 #include "cxqubo/core/context.h"
 #include "cxqubo/core/poly.h"
+#include "cxqubo/misc/flatmap.h"
+#include <algorithm>
+#include <cmath>
+#include <queue>
 
 namespace cxqubo {
 #if 0
@@ -39,72 +43,353 @@ constexpr bool is_termcoeff_inserter =
                                     std::declval<double>())),
                                 bool>;
 
+/// Strategy of reducing terms over the limit.
+enum class Reduction {
+  /// Reduce each term with a chain of its own auxiliary variables.
+  Chain,
+  /// Repeatedly replace the most frequent pair of variables among all terms
+  /// with an auxiliary variable shared by the terms.
+  SharedPairs,
+  /// Choose an encoding for each term by the sign of its coefficient.
+  /// Negative terms take one auxiliary variable (Freedman), and positive ones
+  /// floor((dim-1)/2) variables (Ishikawa), unless a chain takes fewer. Both
+  /// are exact as minimums over the auxiliary variables, so no strength is
+  /// multiplied.
+  MinSelection,
+};
+
+/// Auxiliary variables of reductions, kept to be reused by later reductions
+/// of the same terms.
+struct ReductionCache {
+  /// Variables of each reduced term, which are the first ones of the
+  /// variables a strategy needs.
+  FlatMap<Product, std::vector<Variable>> term_vars;
+  /// Shared variable of each pair of Reduction::SharedPairs, keyed by raw ids
+  /// of the pair. It always stands for the product of the pair.
+  FlatMap<uint64_t, Variable> pair_vars;
+};
+
 template <class Inserter> class LimitedInserter {
   Context &ctx;
   Inserter &inserter;
+  /// Multiplier of penalties Hc. A penalty is weighted by the most energy a
+  /// broken reduction could gain, i.e. |coeff| of the reduced term or the
+  /// sum of them for a shared variable, and a broken Hc is at least 1. So
+  /// any strength from 1 keeps minimums of reduced terms.
   double strength;
   size_t limit = 2;
+  /// Domain of variables in inserted terms. Terms of spins over the limit are
+  /// reduced as binaries x = (s + 1) / 2 of the same variables, and the
+  /// results are inserted as spins again.
+  Vartype vartype = Vartype::BINARY;
+  Reduction reduction = Reduction::Chain;
+  /// Binary terms over the limit kept until 'flush'.
+  NumPoly pending;
+  ReductionCache *cache = nullptr;
+  /// Storage of terms converted to spins.
+  std::vector<Variable> buffer;
 
 public:
   LimitedInserter(Context &ctx, Inserter &inserter, double strength,
-                  size_t limit = 2)
-      : ctx(ctx), inserter(inserter), strength(strength), limit(2) {
+                  size_t limit = 2, Vartype vartype = Vartype::BINARY,
+                  Reduction reduction = Reduction::Chain)
+      : ctx(ctx), inserter(inserter), strength(strength), limit(limit),
+        vartype(vartype), reduction(reduction) {
+    assert(limit >= 2 && "terms can not be reduced under quadratic!");
     static_assert(is_termcoeff_inserter<Inserter>,
                   "template argument must satisfy is_termcoeff_inserter!");
   }
+  ~LimitedInserter() {
+    assert(pending.is_empty() && "terms are left unreduced. Call 'flush()'!");
+  }
 
-  /// Create new variables q[0:dim-limit] and convert
+  /// Create new variables q[0:k] where k = dim-limit and convert
   ///   x_0 * x_1 * ... * x_(dim-1)
   /// ->
-  ///   x_(dim-1) * .. * x_(dim-limit-2) * q_0 +
+  ///   x_(k+1) * .. * x_(dim-1) * q_(k-1) +
   ///   Hc(x_0, x_1, q_0) +
-  ///   Hc(x_2, q_0, q_1) +
+  ///   Hc(q_0, x_2, q_1) +
   ///   ...
-  ///   Hc(x_(dim+limit-4), q_(dim+limit-6), q_(dim+limit-5))
+  ///   Hc(q_(k-2), x_k, q_(k-1))
   ///
-  /// For example, when limit=2, convert
+  /// so that q_i stands for x_0 * .. * x_(i+1). For example, when limit=2,
+  /// convert
   ///   xyz
   /// ->
   ///   zq +  3q + xy - 2yq - 2qx
+  ///
+  /// With Reduction::SharedPairs or in Vartype::SPIN domain, terms over the
+  /// limit are kept until 'flush' and nothing is returned for them. A term of
+  /// spins s_0 * .. * s_(dim-1) is kept as the 2^dim binary terms of
+  /// (2x_0 - 1) * .. * (2x_(dim-1) - 1), so that binary terms shared by
+  /// several spin terms are merged before reduction.
   std::vector<Variable> redce_and_insert(Product term, double coeff) {
-    return redce_and_insert_impl(term, coeff);
-  }
-
-private:
-  std::vector<Variable> redce_and_insert_impl(Product term, double coeff) {
     auto xs = ctx.product_data(term);
     if (inserter.ignore(xs, coeff))
       return {};
 
-    /// Constant or dimention of term is small enough.
-    if (ctx.dim_of(term) <= limit) {
-      insert_or_add(term, coeff);
+    if (xs.size() <= limit) {
+      inserter.insert_or_add(xs, coeff);
+      return {};
+    }
+
+    if (vartype == Vartype::SPIN) {
+      for_each_binary(xs, coeff, [&](SpanRef<Variable> ys, double c) {
+        if (ys.size() <= limit)
+          insert_binary(ys, c);
+        else
+          pending.insert_or_add(ctx, ctx.save_product(ys, true), c);
+      });
+      return {};
+    }
+
+    if (reduction == Reduction::SharedPairs) {
+      pending.insert_or_add(ctx, term, coeff);
+      return {};
+    }
+    return reduce_binary(term, xs, coeff);
+  }
+
+  /// Reduce and insert terms kept by 'redce_and_insert', and return
+  /// auxiliary variables created. This must be called after all terms are
+  /// inserted.
+  std::vector<Variable> flush() {
+    if (pending.is_empty())
       return {};
+
+    std::vector<Variable> qs;
+    if (reduction == Reduction::SharedPairs) {
+      qs = reduce_shared_pairs(pending);
+    } else {
+      for (auto [term, coeff] : pending) {
+        auto xs = ctx.product_data(term);
+        auto ws = reduce_binary(term, xs, coeff);
+        qs.insert(qs.end(), ws.begin(), ws.end());
+      }
+    }
+    pending.clear();
+    return qs;
+  }
+
+  /// Reuse auxiliary variables in \p reductions and keep new ones in it, so
+  /// that reductions of the same terms create no variables. Each term must be
+  /// inserted once, as terms of a polynomial are.
+  void set_cache(ReductionCache &reductions) { cache = &reductions; }
+
+  /// Return true if \p term is reduced before insertion.
+  bool reduces(Product term) const { return ctx.dim_of(term) > limit; }
+
+private:
+  /// Greedily replace the pair of variables shared by the most terms over
+  /// the limit with a new variable q, and insert
+  ///   A * Hc(x, y, q)
+  /// where A is the sum of |coeff| of the replaced terms, until no term is
+  /// over the limit. Counts of pairs are updated incrementally, and stale
+  /// entries of the queue are skipped or pushed again when popped.
+  std::vector<Variable> reduce_shared_pairs(const NumPoly &terms) {
+    struct Term {
+      std::vector<Variable> vars;
+      double coeff;
+    };
+    std::vector<Term> reduced;
+    for (auto [term, coeff] : terms) {
+      auto xs = ctx.product_data(term);
+      reduced.push_back({std::vector<Variable>(xs.begin(), xs.end()), coeff});
+    }
+
+    // Pairs are keyed by raw ids, the smaller first.
+    auto key_of = [](Variable x, Variable y) {
+      uint64_t lo = x.raw_id(), hi = y.raw_id();
+      if (hi < lo)
+        std::swap(lo, hi);
+      return lo << 32 | hi;
+    };
+    FlatMap<uint64_t, unsigned> counts;
+    FlatMap<uint64_t, std::vector<unsigned>> occurs;
+    std::priority_queue<std::pair<unsigned, uint64_t>> queue;
+    auto increment = [&](uint64_t key, unsigned t) {
+      auto count = ++counts[key];
+      occurs[key].push_back(t);
+      queue.emplace(count, key);
+    };
+    auto decrement = [&](uint64_t key) { --counts[key]; };
+
+    for (unsigned t = 0, e = reduced.size(); t != e; ++t) {
+      const auto &vars = reduced[t].vars;
+      for (unsigned i = 0, n = vars.size(); i != n; ++i)
+        for (unsigned j = i + 1; j != n; ++j)
+          increment(key_of(vars[i], vars[j]), t);
+    }
+
+    std::vector<Variable> qs;
+    std::vector<unsigned> ts;
+    while (!queue.empty()) {
+      auto [count, key] = queue.top();
+      queue.pop();
+      auto current = counts[key];
+      if (current != count) {
+        if (current != 0 && current < count)
+          queue.emplace(current, key);
+        continue;
+      }
+
+      auto x = Variable::raw_from(unsigned(key >> 32));
+      auto y = Variable::raw_from(unsigned(key));
+      auto q = pair_var(key);
+      double A = 0.0;
+      ts.clear();
+      ts.swap(occurs[key]);
+      for (auto t : ts) {
+        auto &vars = reduced[t].vars;
+        auto ix = std::find(vars.begin(), vars.end(), x);
+        auto iy = std::find(vars.begin(), vars.end(), y);
+        if (vars.size() <= limit || ix == vars.end() || iy == vars.end())
+          continue;
+
+        vars.erase(std::max(ix, iy));
+        vars.erase(std::min(ix, iy));
+        decrement(key);
+        for (auto v : vars) {
+          decrement(key_of(x, v));
+          decrement(key_of(y, v));
+        }
+        if (vars.size() + 1 > limit) {
+          for (auto v : vars)
+            increment(key_of(v, q), t);
+        } else {
+          for (unsigned i = 0, n = vars.size(); i != n; ++i)
+            for (unsigned j = i + 1; j != n; ++j)
+              decrement(key_of(vars[i], vars[j]));
+        }
+        // A cached q may be older than other shared variables in vars.
+        vars.insert(std::lower_bound(vars.begin(), vars.end(), q), q);
+        A += std::abs(reduced[t].coeff);
+      }
+      insert_Hc(q, x, y, A);
+      qs.push_back(q);
     }
 
+    for (const auto &term : reduced)
+      insert_or_add(ctx.save_product(term.vars, true), term.coeff);
+    return qs;
+  }
+
+  /// Reduce binary \p term of variables \p xs with the strategy.
+  std::vector<Variable> reduce_binary(Product term, SpanRef<Variable> xs,
+                                      double coeff) {
+    auto dim = xs.size();
+    if (reduction == Reduction::MinSelection) {
+      if (coeff < 0.0)
+        return reduce_negative(term, xs, coeff);
+      if ((dim - 1) / 2 <= dim - limit)
+        return reduce_positive(term, xs, coeff);
+    }
+    return reduce_chain(term, xs, coeff);
+  }
+
+  /// Call \p fn with each term of coeff * (2x_0 - 1) * .. * (2x_(dim-1) - 1),
+  /// i.e. coeff * s_0 * .. * s_(dim-1) of spins \p xs in binaries.
+  template <class Fn>
+  void for_each_binary(SpanRef<Variable> xs, double coeff, Fn &&fn) {
+    unsigned dim = xs.size();
+    std::vector<Variable> ys;
+    for (unsigned mask = 0; mask != 1u << dim; ++mask) {
+      ys.clear();
+      for (unsigned i = 0; i != dim; ++i)
+        if (mask >> i & 1)
+          ys.push_back(xs[i]);
+      double c = std::ldexp(coeff, ys.size());
+      fn(ys, (dim - ys.size()) % 2 ? -c : c);
+    }
+  }
+
+  /// Return \p n auxiliary variables for \p term. They are newer than
+  /// variables of any term, so products with them are sorted.
+  std::vector<Variable> aux_vars(Product term, unsigned n) {
+    if (!cache)
+      return ctx.create_unnamed_vars(n, vartype);
+
+    auto &vars = cache->term_vars[term];
+    while (vars.size() < n)
+      vars.push_back(ctx.create_unnamed_var(vartype));
+    return std::vector<Variable>(vars.begin(), vars.begin() + n);
+  }
+
+  /// Return the variable standing for the pair of \p key.
+  Variable pair_var(uint64_t key) {
+    if (!cache)
+      return ctx.create_unnamed_var(vartype);
+
+    auto [it, inserted] = cache->pair_vars.try_emplace(key);
+    if (inserted)
+      it->second = ctx.create_unnamed_var(vartype);
+    return it->second;
+  }
+
+  std::vector<Variable> reduce_chain(Product term, SpanRef<Variable> xs,
+                                     double coeff) {
     auto dim = xs.size();
-    // Create q[0:dim-limit].
-    auto qs = ctx.create_unnamed_vars(dim - limit, Vartype::BINARY);
-
-    // x_(dim-1) * .. * x_(dim-limit-2) * q_0
-    std::vector<Variable> vars(limit);
-    for (unsigned i = 0; i != limit - 1; ++i)
-      vars[i] = xs[dim - i - 1];
-    vars[limit - 1] = qs[0];
+    auto k = dim - limit;
+    // Create q[0:k].
+    auto qs = aux_vars(term, k);
+
+    // x_(k+1) * .. * x_(dim-1) * q_(k-1), which is sorted as q_(k-1) is
+    // newer than variables of terms.
+    std::vector<Variable> vars(xs.begin() + k + 1, xs.end());
+    vars.push_back(qs[k - 1]);
     insert_or_add(ctx.save_product(vars, true), coeff);
 
+    // Penalties must be positive whatever the sign of coeff is.
     // Hc(x_0, x_1, q_0)
-    insert_Hc(qs[0], xs[0], xs[1], coeff);
+    insert_Hc(qs[0], xs[0], xs[1], std::abs(coeff));
 
-    if (dim >= limit + 2) {
-      // limit >= 2 and dim >= 4, so dim + limit - 6 >= 0
-      for (unsigned i = 0, e = dim + limit - 6; i < e; ++i)
-        insert_Hc(qs[i + 1], qs[i], xs[i + 2], coeff);
-    }
+    // Hc(q_i, x_(i+2), q_(i+1))
+    for (unsigned i = 0; i + 1 < k; ++i)
+      insert_Hc(qs[i + 1], qs[i], xs[i + 2], std::abs(coeff));
 
     return qs;
   }
 
+  /// Create a new variable w and convert, for coeff < 0,
+  ///   coeff * x_0 * x_1 * ... * x_(dim-1)
+  /// ->
+  ///   coeff * w * (x_0 + x_1 + ... + x_(dim-1) - (dim-1))
+  std::vector<Variable> reduce_negative(Product term, SpanRef<Variable> xs,
+                                        double coeff) {
+    auto w = aux_vars(term, 1)[0];
+    for (auto x : xs)
+      insert_or_add(ctx.save_product({x, w}, true), coeff);
+    insert_or_add(ctx.save_product({w}, true), -coeff * (xs.size() - 1));
+    return {w};
+  }
+
+  /// Create new variables w[1:n+1] where n = floor((dim-1)/2) and convert,
+  /// for coeff > 0,
+  ///   coeff * x_0 * x_1 * ... * x_(dim-1)
+  /// ->
+  ///   coeff * (S2 + sum_i w_i * (c_i * (2i - S1) - 1))
+  /// where S1 and S2 are the sums of x_j and x_j * x_k (j < k), and c_i is 1
+  /// if dim is odd and i = n, otherwise 2.
+  std::vector<Variable> reduce_positive(Product term, SpanRef<Variable> xs,
+                                        double coeff) {
+    auto dim = xs.size();
+    auto n = (dim - 1) / 2;
+    auto ws = aux_vars(term, n);
+
+    for (unsigned j = 0; j != dim; ++j)
+      for (unsigned k = j + 1; k != dim; ++k)
+        insert_or_add(ctx.save_product({xs[j], xs[k]}, true), coeff);
+
+    for (unsigned i = 1; i <= n; ++i) {
+      auto w = ws[i - 1];
+      double c = dim % 2 == 1 && i == n ? 1.0 : 2.0;
+      insert_or_add(ctx.save_product({w}, true), coeff * (2.0 * c * i - 1.0));
+      for (auto x : xs)
+        insert_or_add(ctx.save_product({x, w}, true), -coeff * c);
+    }
+    return ws;
+  }
+
   /// Insert A * Hc(q, x, y) = A * (3q + xy - 2yq - 2qx)
   void insert_Hc(Variable q, Variable x, Variable y, double A) {
     auto xy = ctx.save_product({x, y}, false);
@@ -116,8 +401,28 @@ private:
     insert_or_add(yq, -2.0 * A * strength);
   }
 
+  /// Insert binary \p term, which is converted to spins in Vartype::SPIN
+  /// domain.
   void insert_or_add(Product term, double coeff) {
-    inserter.insert_or_add(ctx.product_data(term), coeff);
+    insert_binary(ctx.product_data(term), coeff);
+  }
+
+  void insert_binary(SpanRef<Variable> xs, double coeff) {
+    if (vartype == Vartype::BINARY) {
+      inserter.insert_or_add(xs, coeff);
+      return;
+    }
+
+    // x_0 * .. * x_(dim-1) = (s_0 + 1) * .. * (s_(dim-1) + 1) / 2^dim
+    unsigned dim = xs.size();
+    double c = std::ldexp(coeff, -int(dim));
+    for (unsigned mask = 0; mask != 1u << dim; ++mask) {
+      buffer.clear();
+      for (unsigned i = 0; i != dim; ++i)
+        if (mask >> i & 1)
+          buffer.push_back(xs[i]);
+      inserter.insert_or_add(buffer, c);
+    }
   }
 };
 } // namespace cxqubo
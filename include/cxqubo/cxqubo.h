@@ -20,6 +20,7 @@
 #include "cxqubo/core/reducer.h"
 #include "cxqubo/misc/drawable.h"
 #include "cxqubo/misc/strsaver.h"
+#include <limits>
 #include <optional>
 #include <sstream>
 
@@ -27,7 +28,18 @@
 #include "cimod/vartypes.hpp"
 
 namespace cxqubo {
+/// Strength of reductions by default. A broken reduction is penalized by 5
+/// times the bound of energy its breaking could gain, so auxiliary variables
+/// of Reduction::Chain and Reduction::SharedPairs in a minimum are the
+/// products they stand for.
 inline constexpr double DEFAULT_STRENGTH = 5.0;
+/// The smallest strength keeping ground states, where each penalty of a
+/// reduction equals the bound of energy its breaking could gain. A broken
+/// reduction may tie with a ground state, but never goes below it, so
+/// auxiliary variables of a minimum may be inconsistent.
+inline constexpr double AUTO_STRENGTH = 1.0;
+/// Degree limit under which no term is reduced.
+inline constexpr size_t NO_DEGREE_LIMIT = std::numeric_limits<size_t>::max();
 
 using Linear = cimod::Linear<unsigned, double>;
 using Quadratic = cimod::Quadratic<unsigned, double>;
@@ -35,6 +47,15 @@ using Quadratic = cimod::Quadratic<unsigned, double>;
 using DecodedLinear = cimod::Linear<std::string_view, double>;
 using DecodedQuadratic = cimod::Quadratic<std::string_view, double>;
 
+/// Hash of a term of sorted variable indexes.
+struct TermHash {
+  size_t operator()(const std::vector<unsigned> &term) const {
+    return term.empty() ? 0 : hash_range(term.begin(), term.end());
+  }
+};
+/// Polynomial of any degree, whose terms are sorted variable indexes.
+using Polynomial = std::unordered_map<std::vector<unsigned>, double, TermHash>;
+
 using BinaryQuadraticModel =
     cimod::BinaryQuadraticModel<unsigned, double, cimod::Dense>;
 
@@ -117,18 +138,20 @@ public:
 /// Class compressing sparse variable indexes to dense indexes.
 struct DenseIndexer {
   std::vector<unsigned> *to_sparse = nullptr;
-  std::unordered_map<unsigned, unsigned> sparse_to_dense;
+  FlatMap<unsigned, unsigned> sparse_to_dense;
+  /// Storage of the last result of 'indexes'.
+  std::vector<unsigned> buffer;
 
 public:
   DenseIndexer(std::vector<unsigned> *to_sparse = nullptr)
       : to_sparse(to_sparse) {}
 
-  std::vector<unsigned> indexes(SpanRef<Variable> term) {
-    unsigned n = term.size();
-    std::vector<unsigned> vec(n, Variable::none().index());
-    for (unsigned i = 0; i != n; ++i)
-      vec[i] = get_or_assign(term[i].index());
-    return vec;
+  /// Return dense indexes of \p term, which are valid until the next call.
+  SpanRef<unsigned> indexes(SpanRef<Variable> term) {
+    buffer.clear();
+    for (auto var : term)
+      buffer.push_back(get_or_assign(var.index()));
+    return buffer;
   }
 
   void reset(std::vector<unsigned> *to_sparse = nullptr) {
@@ -165,7 +188,8 @@ private:
   }
 };
 
-/// BQM paramter generator.
+/// BQM paramter generator. Terms are products of variables of either domain,
+/// so this also generates Ising parameters of spin terms.
 struct BQMInserter {
   Linear linear;
   Quadratic quad;
@@ -248,6 +272,35 @@ public:
   }
 };
 
+/// HUBO generator. Terms of any degree are inserted with sorted indexes.
+struct HUBOInserter {
+  Polynomial poly;
+  double offset = 0.0;
+  DenseIndexer &indexer;
+
+public:
+  HUBOInserter(DenseIndexer &indexer) : indexer(indexer) {}
+  /// Always insert.
+  bool ignore(SpanRef<Variable>, double) const { return false; }
+  /// Implementation.
+  void insert_or_add(SpanRef<Variable> term, double coeff) {
+    if (coeff == 0.0)
+      return;
+
+    auto indexes = indexer.indexes(term);
+    if (indexes.empty()) {
+      offset += coeff;
+      return;
+    }
+
+    std::vector<unsigned> key(indexes.begin(), indexes.end());
+    std::sort(key.begin(), key.end());
+    auto [it, inserted] = poly.emplace(std::move(key), coeff);
+    if (!inserted)
+      it->second += coeff;
+  }
+};
+
 /// Context manager and interface of CXQUBO entities.User generates variables
 /// and expressions via CXQUBOModel. All entities constructing a model generated
 /// from CXQUBOModel are disposed after lifetime of CXQUBOModel.
@@ -272,6 +325,8 @@ class CXQUBOModel {
   std::vector<SpanOwner<unsigned>> array_shapes;
   /// Fixed variables' values.
   Sample fixed;
+  /// Strategy of reducing terms over quadratic.
+  Reduction reduction = Reduction::Chain;
 
 public:
   CXQUBOModel(Context &ctx) : ctx(ctx) {}
@@ -287,7 +342,7 @@ public:
 
   std::pair<Express, Vartype> get_var(std::string_view name) const {
     Variable var = ctx.var_of(name);
-    Vartype type = ctx.var_data(var).type;
+    Vartype type = ctx.var_type(var);
     return {Express(&ctx, ctx.variable(var)), type};
   }
 
@@ -306,12 +361,24 @@ public:
   std::unordered_map<std::string, std::string>
   decode(const Compiled &compiled) {
     std::unordered_map<std::string, std::string> result;
-    for (auto [term, coeff] : compiled.poly) {
+    auto decode_term = [this, &result](Product term, auto coeff) {
       std::stringstream term_ss;
       std::stringstream coeff_ss;
       ctx.draw_product(term_ss, term);
-      ctx.draw_expr(coeff_ss, coeff);
+      if constexpr (std::is_same_v<decltype(coeff), AffineCoeff>)
+        ctx.draw_expr(coeff_ss,
+                      CoeffTraits<AffineCoeff>::as_expr(ctx, coeff));
+      else
+        coeff_ss << Fp{coeff};
       result.emplace(term_ss.str(), coeff_ss.str());
+    };
+
+    if (auto *p = compiled.poly.as_ptr_if<NumPoly>()) {
+      for (auto [term, coeff] : *p)
+        decode_term(term, coeff);
+    } else if (auto *p = compiled.poly.as_ptr_if<AffinePoly>()) {
+      for (auto [term, coeff] : *p)
+        decode_term(term, coeff);
     }
     return result;
   }
@@ -371,19 +438,15 @@ public:
   /// Return an array which includes several variables.
   Array add_vars(ArrayShape shape, Vartype type,
                  std::string_view basename = "") {
-    Expr base;
-    for (auto indexes : shape_range(shape)) {
-      std::string_view name = basename;
-      if (!name.empty()) {
-        std::stringstream ss;
-        ss << name;
-        for (size_t i : indexes)
-          ss << '[' << i << ']';
-
-        name = ctx.save_string(ss.str());
-      }
+    // Names of elements are computed by the context on demand.
+    Variable first;
+    if (!basename.empty())
+      first = ctx.create_array_vars(basename, shape, type);
 
-      auto var = ctx.create_var(name, type);
+    Expr base;
+    for (size_t i = 0, n = shape.nelements(); i != n; ++i) {
+      auto var = first ? Variable::from(first.index() + i)
+                       : ctx.create_unnamed_var(type);
       Expr expr = ctx.variable(var);
       if (!base)
         base = expr;
@@ -394,11 +457,47 @@ public:
     return Array(&ctx, base, array_shapes.back().as_spanref());
   }
 
+  /// Return the array of sums of \p array along \p axis. Each sum is built
+  /// as one list, so the sums are consecutive expressions.
+  Array sum(const Array &array, unsigned axis) {
+    ArrayShape shape = array.shape();
+    assert(axis < shape.size() && "axis out of bounds!");
+    assert(shape[axis] != 0 && "sum along an empty axis!");
+
+    // Elements are at outer * (n * inner) + k * inner + i for k in [0, n).
+    size_t n = shape[axis];
+    size_t outer = 1, inner = 1;
+    std::vector<unsigned> result_shape;
+    for (unsigned d = 0, e = shape.size(); d != e; ++d) {
+      if (d < axis)
+        outer *= shape[d];
+      else if (d > axis)
+        inner *= shape[d];
+      if (d != axis)
+        result_shape.push_back(shape[d]);
+    }
+
+    Expr base;
+    std::vector<Expr> operands(n);
+    for (size_t o = 0; o != outer; ++o) {
+      for (size_t i = 0; i != inner; ++i) {
+        for (size_t k = 0; k != n; ++k)
+          operands[k] = array.at_offset((o * n + k) * inner + i).ref;
+        Expr e = ctx.list(Op::Add, operands);
+        if (!base)
+          base = e;
+      }
+    }
+
+    array_shapes.push_back(span_owner(SpanRef<unsigned>(result_shape)));
+    return Array(&ctx, base, array_shapes.back().as_spanref());
+  }
+
   /// Fix a variable to the given spin value.
   void fix(Express expr, int32_t v) {
     Variable var = ctx.expr_var(expr.ref);
     assert(var && "lhs in 'fix' method must be a variable!");
-    Vartype from = ctx.var_data(var).type;
+    Vartype from = ctx.var_type(var);
     fixed.emplace(var.index(), convert_spin_value(v, from, Vartype::BINARY));
   }
   /// Fix variables to the given spin value.
@@ -419,10 +518,20 @@ public:
       fix(vars[i], vals[i]);
   }
 
+  /// Select the strategy of reducing terms over quadratic for later
+  /// conversions. Reduction::SharedPairs shares auxiliary variables among
+  /// terms, and usually creates much fewer of them.
+  void set_reduction(Reduction strategy) { reduction = strategy; }
+
 public:
-  /// Compile an expression represented in AST to polynomial form.
-  Compiled compile(Express root) {
-    return Compiler(ctx).compile(root.ref, fixed);
+  /// Compile an expression represented in AST to polynomial form. Summands of
+  /// \p root are compiled in parallel if \p num_threads is more than 1.
+  /// Variables in products are in \p vartype domain, and Vartype::SPIN keeps
+  /// spins as they are for Ising models. Terms of spins over quadratic are
+  /// reduced through binaries x = (s + 1) / 2 on conversion.
+  Compiled compile(Express root, unsigned num_threads = 1,
+                   Vartype vartype = Vartype::BINARY) {
+    return Compiler(ctx, num_threads).compile(root.ref, fixed, vartype);
   }
   /// Convert a polynomial to cimod's and dimod's BQM parameters. The following
   /// conversions will be applied.
@@ -430,8 +539,11 @@ public:
   /// * Placeholders are replaced to values given in \p feed_dict.
   /// * Terms with dimentions over 2 are reduced to expression 2 or less and \p
   ///   strength is multiplied to the reduced expression as reducing strength.
+  ///   AUTO_STRENGTH gives the weakest penalties keeping ground states.
   /// * Variables' indexes are generally sparse, and they are converted to
   ///   densed ones when \p to_sparse is not nullptr.
+  ///
+  /// Parameters are of the domain \p compiled is compiled in.
   std::tuple<Linear, Quadratic, double>
   create_bqm_params(const Compiled &compiled, std::vector<unsigned> *to_sparse,
                     const FeedDict &feed_dict = FeedDict{},
@@ -456,7 +568,7 @@ public:
     auto [linear, quad, offset] =
         create_bqm_params(compiled, to_sparse, feed_dict, strength);
     return BinaryQuadraticModel(linear, quad, offset,
-                                cimod_vartype(Vartype::BINARY));
+                                cimod_vartype(compiled.vartype));
   }
   BinaryQuadraticModel create_bqm(const Compiled &compiled,
                                   const FeedDict &feed_dict = FeedDict{},
@@ -470,6 +582,9 @@ public:
   create_qubo(const Compiled &compiled, std::vector<unsigned> *to_sparse,
               const FeedDict &feed_dict = FeedDict{},
               double strength = DEFAULT_STRENGTH) {
+    if (compiled.vartype == Vartype::SPIN)
+      return create_bqm(compiled, to_sparse, feed_dict, strength).to_qubo();
+
     DenseIndexer indexer(to_sparse);
     QUBOInserter inserter(indexer);
     create_solver_model(compiled, inserter, feed_dict, strength);
@@ -481,11 +596,18 @@ public:
     return create_qubo(compiled, nullptr, feed_dict, strength);
   }
 
-  /// Convert a polynomial to ising format.
+  /// Convert a polynomial to ising format. A polynomial compiled in
+  /// Vartype::SPIN domain is converted directly.
   std::tuple<Linear, Quadratic, double>
   create_ising(const Compiled &compiled, std::vector<unsigned> *to_sparse,
                const FeedDict &feed_dict = FeedDict{},
                double strength = DEFAULT_STRENGTH) {
+    if (compiled.vartype == Vartype::SPIN) {
+      DenseIndexer indexer(to_sparse);
+      BQMInserter inserter(indexer);
+      create_solver_model(compiled, inserter, feed_dict, strength);
+      return std::make_tuple(inserter.linear, inserter.quad, inserter.offset);
+    }
     return create_bqm(compiled, to_sparse, feed_dict, strength).to_ising();
   }
   std::tuple<Linear, Quadratic, double>
@@ -494,24 +616,110 @@ public:
     return create_ising(compiled, nullptr, feed_dict, strength);
   }
 
+  /// Convert a polynomial to a HUBO of terms of any degree. Terms over \p
+  /// limit are reduced as in 'create_bqm_params', so no auxiliary variable
+  /// is created by default.
+  ///
+  /// Terms are of the domain \p compiled is compiled in.
+  std::tuple<Polynomial, double>
+  create_hubo(const Compiled &compiled, std::vector<unsigned> *to_sparse,
+              const FeedDict &feed_dict = FeedDict{},
+              double strength = DEFAULT_STRENGTH,
+              size_t limit = NO_DEGREE_LIMIT) {
+    DenseIndexer indexer(to_sparse);
+    HUBOInserter inserter(indexer);
+    create_solver_model(compiled, inserter, feed_dict, strength, limit);
+    return std::make_tuple(inserter.poly, inserter.offset);
+  }
+  std::tuple<Polynomial, double>
+  create_hubo(const Compiled &compiled, const FeedDict &feed_dict = FeedDict{},
+              double strength = DEFAULT_STRENGTH,
+              size_t limit = NO_DEGREE_LIMIT) {
+    return create_hubo(compiled, nullptr, feed_dict, strength, limit);
+  }
+
   /// Convert a polynomial to an arbitary solver model. If you want to convert
   /// a polynomial to your own model, prepare \p Inserter and pass it as an
-  /// argument.
+  /// argument. Terms over \p limit are reduced before insertion, reusing
+  /// auxiliary variables of earlier conversions of \p compiled.
   template <class Inserter>
   void create_solver_model(const Compiled &compiled, Inserter &inserter,
                            const FeedDict &feed_dict = FeedDict{},
-                           double strength = DEFAULT_STRENGTH) {
+                           double strength = DEFAULT_STRENGTH,
+                           size_t limit = 2) {
     // TODO: Throw exception.
     assert(!compiled.poly.empty() &&
            "Polynomial has not been created. Call 'compile()' method.");
 
-    PlaceholderExpander expander(ctx, feed_dict);
-    auto reducer = LimitedInserter(ctx, inserter, strength);
+    auto reducer = LimitedInserter(ctx, inserter, strength, limit,
+                                   compiled.vartype, reduction);
+    reducer.set_cache(*compiled.reductions);
+
+    // Numeric coefficients need no placeholder expansion.
+    if (auto *p = compiled.poly.as_ptr_if<NumPoly>()) {
+      for (auto [term, coeff] : *p)
+        reducer.redce_and_insert(term, coeff);
+      reducer.flush();
+      return;
+    }
 
-    for (auto [term, coeff_expr] : compiled.poly) {
-      double coeff = expander.expand(coeff_expr);
+    PlaceholderExpander expander(ctx, feed_dict);
+    for (const auto &[term, affine] : compiled.poly.as<AffinePoly>()) {
+      double coeff = expander.expand(affine);
       reducer.redce_and_insert(term, coeff);
     }
+    reducer.flush();
+  }
+
+  /// Compile \p root and insert its terms into \p inserter without keeping
+  /// the whole polynomial. Summands of a top-level sum are compiled and
+  /// inserted one by one, so a term of several summands is inserted as many
+  /// times and \p inserter must accumulate them. Terms to be reduced are
+  /// merged first and reduced at the end, as done by 'create_solver_model'.
+  /// Variables of terms are in \p vartype domain as in 'compile', and terms
+  /// over \p limit are reduced.
+  template <class Inserter>
+  void compile_into(Express root, Inserter &inserter,
+                    const FeedDict &feed_dict = FeedDict{},
+                    double strength = DEFAULT_STRENGTH,
+                    Vartype vartype = Vartype::BINARY, size_t limit = 2) {
+    auto reducer =
+        LimitedInserter(ctx, inserter, strength, limit, vartype, reduction);
+    NumPoly reduced;
+    auto insert = [&](Product term, double coeff) {
+      if (reducer.reduces(term))
+        reduced.insert_or_add(ctx, term, coeff);
+      else
+        reducer.redce_and_insert(term, coeff);
+    };
+
+    // Summands of root, which is a sum of itself unless it is an Add list.
+    const Expr *single = &root.ref;
+    auto first = List::iterator(single + 1), last = List::iterator(single);
+    if (auto *p = ctx.expr_data(root.ref).as_ptr_if<List>();
+        p && p->op == Op::Add) {
+      first = p->begin();
+      last = p->end();
+    }
+
+    if (PlaceholderFinder(ctx).find(root.ref)) {
+      AffineParser parser(ctx, fixed, vartype);
+      PlaceholderExpander expander(ctx, feed_dict);
+      parser.parse_each(first, last, [&](const AffinePoly &poly) {
+        for (const auto &[term, affine] : poly)
+          insert(term, expander.expand(affine));
+      });
+    } else {
+      NumParser parser(ctx, fixed, vartype);
+      parser.parse_each(first, last, [&](const NumPoly &poly) {
+        for (auto [term, coeff] : poly)
+          insert(term, coeff);
+      });
+    }
+
+    for (auto [term, coeff] : reduced)
+      reducer.redce_and_insert(term, coeff);
+    reducer.flush();
   }
 
   /// Return readable sampling result.
@@ -1,16 +1,18 @@
 /// Allocators simplifying LLVM's allocators.
 ///
 /// https://github.com/llvm/llvm-project/blob/main/llvm/include/llvm/Support/Allocator.h
-/// TODO:
 /// https://github.com/llvm/llvm-project/blob/main/llvm/include/llvm/Support/Recycler.h
+/// TODO:
 /// https://github.com/llvm/llvm-project/blob/main/llvm/include/llvm/Support/RecyclingAllocator.h
 
 #ifndef CXQUBO_MISC_ALLOCATOR_H
 #define CXQUBO_MISC_ALLOCATOR_H
 
 #include "cxqubo/misc/type_traits.h"
+#include <algorithm>
 #include <cstddef>
 #include <new>
+#include <utility>
 #include <vector>
 
 namespace cxqubo {
@@ -40,8 +42,15 @@ inline void deallocate_memory(void *ptr, size_t size, size_t alignment) {
 
 template <class T, size_t NOBJECT = 4096 / sizeof(T), size_t NDELAY = 16>
 class TypeBumpAllocator {
+  struct Block {
+    char *ptr = nullptr;
+    size_t size = 0;
+    /// Size of the constructed or allocated part. Tracked by 'cur' for the
+    /// last block.
+    size_t used = 0;
+  };
   /// Allocated blocks.
-  std::vector<char *> blocks;
+  std::vector<Block> blocks;
   /// Pointing beginning of current free space in the current block.
   char *cur = nullptr;
   /// Pointing end of the current block.
@@ -70,13 +79,15 @@ public:
     end = nullptr;
   }
 
-  /// Allocate memory space for an instance without ctor.
-  void *allocate(unsigned n = 1) {
+  /// Allocate memory space for n contiguous instances without ctor.
+  void *allocate(size_t n = 1) {
     if (size_t(end - cur) < n * SIZE) {
-      size_t bs = allocate_size(blocks.size());
+      if (!blocks.empty())
+        blocks.back().used = cur - blocks.back().ptr;
+      size_t bs = std::max(allocate_size(blocks.size()), n * SIZE);
       cur = reinterpret_cast<char *>(impl::allocate_memory(bs, alignof(T)));
       end = cur + bs;
-      blocks.emplace_back(cur);
+      blocks.push_back(Block{cur, bs});
     }
 
     char *tmp = cur;
@@ -102,21 +113,50 @@ private:
         reinterpret_cast<T *>(p)->~T();
     };
     for (unsigned i = 0, n = blocks.size(); i != n; ++i) {
-      char *p = blocks[i];
-      if (!p)
+      auto &block = blocks[i];
+      if (!block.ptr)
         continue;
 
       // Call dtors.
-      char *b = p;
-      char *e = p == blocks.back() ? cur : p + allocate_size(i);
+      char *b = block.ptr;
+      char *e = i + 1 == n ? cur : b + block.used;
       destroy_elements(b, e);
 
       // Remove the block.
-      impl::deallocate_memory(p, allocate_size(i), alignof(T));
-      blocks[i] = nullptr;
+      impl::deallocate_memory(b, block.size, alignof(T));
+      block.ptr = nullptr;
     }
   }
 };
+
+/// Pool of cleared objects, e.g. containers, whose storage is reused by later
+/// acquisitions instead of being freed. At most NMAX objects are kept.
+template <class T, size_t NMAX = 64> class Recycler {
+  std::vector<T> pool;
+
+public:
+  /// Return an empty object, reusing a recycled one if any.
+  T acquire() {
+    if (pool.empty())
+      return T();
+
+    T obj = std::move(pool.back());
+    pool.pop_back();
+    return obj;
+  }
+
+  /// Clear \p obj and keep it for later acquisitions.
+  void recycle(T &&obj) {
+    if (pool.size() == NMAX)
+      return;
+
+    obj.clear();
+    pool.emplace_back(std::move(obj));
+  }
+
+  /// Number of objects kept.
+  size_t size() const { return pool.size(); }
+};
 } // namespace cxqubo
 
 #endif
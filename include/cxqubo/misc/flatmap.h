@@ -0,0 +1,229 @@
+#ifndef CXQUBO_MISC_FLATMAP_H
+#define CXQUBO_MISC_FLATMAP_H
+
+#include "cxqubo/misc/error_handling.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <ostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace cxqubo {
+/// Hash map with open addressing. Entries are stored contiguously in insertion
+/// order, and found through a power-of-two table of entry indexes probed
+/// linearly. Each slot keeps the hash of its entry, so probing and growing
+/// rarely touch the entries themselves.
+///
+/// Entries can not be erased one by one. As with std::vector, an insertion
+/// may invalidate iterators and references to entries. Keys are const in
+/// entries as in std::unordered_map, since slots keep their hashes.
+template <class K, class V, class Hash = std::hash<K>,
+          class KeyEqual = std::equal_to<K>>
+class FlatMap {
+public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+  using size_type = size_t;
+  using iterator = typename std::vector<value_type>::iterator;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+private:
+  static constexpr uint32_t EMPTY = ~uint32_t(0);
+  static constexpr size_t MIN_SLOTS = 8;
+
+  struct Slot {
+    uint32_t index = EMPTY;
+    uint32_t hash = 0;
+  };
+
+  std::vector<value_type> entries;
+  std::vector<Slot> slots;
+  Hash hasher;
+  KeyEqual key_equal;
+
+public:
+  FlatMap() = default;
+  FlatMap(std::initializer_list<value_type> init) {
+    reserve(init.size());
+    for (const auto &[k, v] : init)
+      try_emplace(k, v);
+  }
+  FlatMap(const FlatMap &) = default;
+  FlatMap(FlatMap &&) = default;
+  /// Entries with const keys can not be assigned, so copy and swap.
+  FlatMap &operator=(const FlatMap &rhs) {
+    if (this != &rhs) {
+      FlatMap copy(rhs);
+      swap(copy);
+    }
+    return *this;
+  }
+  FlatMap &operator=(FlatMap &&) = default;
+
+  void swap(FlatMap &rhs) {
+    using std::swap;
+    swap(entries, rhs.entries);
+    swap(slots, rhs.slots);
+    swap(hasher, rhs.hasher);
+    swap(key_equal, rhs.key_equal);
+  }
+
+  size_type size() const { return entries.size(); }
+  bool empty() const { return entries.empty(); }
+
+  iterator begin() { return entries.begin(); }
+  iterator end() { return entries.end(); }
+  const_iterator begin() const { return entries.begin(); }
+  const_iterator end() const { return entries.end(); }
+  const_iterator cbegin() const { return entries.cbegin(); }
+  const_iterator cend() const { return entries.cend(); }
+
+  /// Make room for n entries without growing the table.
+  void reserve(size_type n) {
+    entries.reserve(n);
+    if (!fits(n, slots.size()))
+      rehash(slots_for(n));
+  }
+
+  /// Remove all entries but keep the allocated storage.
+  void clear() {
+    entries.clear();
+    std::fill(slots.begin(), slots.end(), Slot());
+  }
+
+  iterator find(const K &key) {
+    uint32_t index = lookup(key);
+    return index == EMPTY ? end() : begin() + index;
+  }
+  const_iterator find(const K &key) const {
+    uint32_t index = lookup(key);
+    return index == EMPTY ? end() : begin() + index;
+  }
+  size_type count(const K &key) const { return lookup(key) != EMPTY; }
+
+  /// Insert a value constructed from args unless key already exists.
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(const K &key, Args &&...args) {
+    if (!fits(entries.size() + 1, slots.size()))
+      rehash(slots_for(entries.size() + 1));
+
+    uint32_t hash = hash_of(key);
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot &slot = slots[i];
+      if (slot.index == EMPTY) {
+        slot = {uint32_t(entries.size()), hash};
+        entries.emplace_back(std::piecewise_construct,
+                             std::forward_as_tuple(key),
+                             std::forward_as_tuple(std::forward<Args>(args)...));
+        return {end() - 1, true};
+      }
+      if (slot.hash == hash && key_equal(entries[slot.index].first, key))
+        return {begin() + slot.index, false};
+    }
+  }
+  template <class... Args>
+  std::pair<iterator, bool> emplace(const K &key, Args &&...args) {
+    return try_emplace(key, std::forward<Args>(args)...);
+  }
+
+  V &operator[](const K &key) { return try_emplace(key).first->second; }
+
+  V &at(const K &key) {
+    uint32_t index = lookup(key);
+    if (index == EMPTY)
+      unreachable_code("FlatMap::at: key not found!");
+    return entries[index].second;
+  }
+  const V &at(const K &key) const {
+    uint32_t index = lookup(key);
+    if (index == EMPTY)
+      unreachable_code("FlatMap::at: key not found!");
+    return entries[index].second;
+  }
+
+  friend bool operator==(const FlatMap &lhs, const FlatMap &rhs) {
+    if (lhs.size() != rhs.size())
+      return false;
+    for (const auto &[k, v] : lhs) {
+      auto it = rhs.find(k);
+      if (it == rhs.end() || !(it->second == v))
+        return false;
+    }
+    return true;
+  }
+  friend bool operator!=(const FlatMap &lhs, const FlatMap &rhs) {
+    return !(lhs == rhs);
+  }
+
+private:
+  /// Keep the load factor at most 3/4.
+  static bool fits(size_t n, size_t num_slots) {
+    return n * 4 <= num_slots * 3;
+  }
+  static size_t slots_for(size_t n) {
+    size_t num_slots = MIN_SLOTS;
+    while (!fits(n, num_slots))
+      num_slots *= 2;
+    return num_slots;
+  }
+
+  /// Spread the user hash with a Fibonacci multiply, since std::hash is the
+  /// identity for integers and our keys are mostly dense indexes.
+  uint32_t hash_of(const K &key) const {
+    uint64_t h = uint64_t(hasher(key)) * 0x9E3779B97F4A7C15ull;
+    return uint32_t(h >> 32);
+  }
+
+  uint32_t lookup(const K &key) const {
+    if (entries.empty())
+      return EMPTY;
+    uint32_t hash = hash_of(key);
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots[i];
+      if (slot.index == EMPTY)
+        return EMPTY;
+      if (slot.hash == hash && key_equal(entries[slot.index].first, key))
+        return slot.index;
+    }
+  }
+
+  void rehash(size_t num_slots) {
+    std::vector<Slot> old(num_slots);
+    old.swap(slots);
+    size_t mask = num_slots - 1;
+    for (const Slot &slot : old) {
+      if (slot.index == EMPTY)
+        continue;
+      size_t i = slot.hash & mask;
+      while (slots[i].index != EMPTY)
+        i = (i + 1) & mask;
+      slots[i] = slot;
+    }
+  }
+};
+
+template <class K, class V, class H, class E>
+inline std::ostream &operator<<(std::ostream &os,
+                                const FlatMap<K, V, H, E> &m) noexcept {
+  os << "{";
+
+  unsigned cnt = 0;
+  for (const auto &[k, v] : m) {
+    if (cnt++ != 0)
+      os << ' ';
+    os << k << ": " << v;
+    if (cnt != m.size())
+      os << ",\n";
+  }
+
+  return os << "}";
+}
+} // namespace cxqubo
+
+#endif
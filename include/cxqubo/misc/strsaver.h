@@ -2,16 +2,19 @@
 #define CXQUBO_MISC_STRSAVER_H
 
 #include "cxqubo/misc/allocator.h"
-#include <set>
-#include <string>
+#include "cxqubo/misc/flatmap.h"
+#include <cstring>
 #include <string_view>
 
 namespace cxqubo {
-using StringAllocator = TypeBumpAllocator<std::string>;
+using StringAllocator = TypeBumpAllocator<char>;
 
+/// String interner. Characters of saved strings are packed into the arena of
+/// StringAllocator, and found through a flat hash index.
 class StringSaver {
   StringAllocator &alloc;
-  std::set<std::string_view> strings;
+  /// Index of saved strings. Values are unused.
+  FlatMap<std::string_view, bool> strings;
 
 public:
   StringSaver(StringAllocator &alloc) : alloc(alloc) {}
@@ -21,16 +24,15 @@ public:
       return "";
 
     auto it = strings.find(str);
-    if (it == strings.end()) {
-      str = new_string(str);
-      auto [it2, flag] = strings.insert(str);
-      it = it2;
-    }
-    return *it;
+    if (it == strings.end())
+      it = strings.try_emplace(new_string(str)).first;
+    return it->first;
   }
 
   std::string_view new_string(std::string_view str) {
-    return *(new (alloc.allocate()) std::string{str});
+    auto *ptr = static_cast<char *>(alloc.allocate(str.size()));
+    std::memcpy(ptr, str.data(), str.size());
+    return std::string_view(ptr, str.size());
   }
 
   bool contains(std::string_view str) const {
@@ -12,6 +12,11 @@ template <class... Ts> struct Variant : public std::variant<Ts...> {
   using Super::Super;
   using Super::operator=;
 
+  /// Index of alternative \p T.
+  template <class T> static constexpr TypeIndex index_of() {
+    return type_index_of<T, Ts...>;
+  }
+
   operator Super &() { return *this; }
   operator const Super &() const { return *this; }
 
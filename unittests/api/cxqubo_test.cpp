@@ -1,5 +1,7 @@
 #include "cxqubo/cxqubo.h"
 #include "gtest/gtest.h"
+#include <limits>
+#include <set>
 
 using namespace cxqubo;
 
@@ -19,5 +21,364 @@ TEST(cxqubo_test, array) {
   EXPECT_EQ("x[1][0]", context.expr_name((*xs[1][0]).ref));
   EXPECT_EQ("x[1][1]", context.expr_name((*xs[1][1]).ref));
   EXPECT_EQ("x[1][2]", context.expr_name((*xs[1][2]).ref));
+
+  // Names of elements are parsed back to variables.
+  EXPECT_EQ(context.expr_var((*xs[1][2]).ref),
+            context.expr_var(model.get_var("x[1][2]").first.ref));
+  EXPECT_EQ(context.expr_var((*xs[0][1]).ref), context.var_of("x[0][1]"));
+  EXPECT_TRUE(context.contains_var("x[2]"));
+  EXPECT_FALSE(context.contains_var("x[3]"));
+  EXPECT_FALSE(context.contains_var("x[01]"));
+  EXPECT_FALSE(context.contains_var("x[1][2]x"));
+  EXPECT_FALSE(context.contains_var("x[1][3]"));
+  EXPECT_FALSE(context.contains_var("y[0]"));
+}
+
+TEST(cxqubo_test, compile_into) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(4, Vartype::BINARY, "x");
+  auto s = model.add_spin("s");
+  auto w = model.placeholder("w");
+  auto shared = (*x[0] + *x[1] - 1.0).pow(2);
+  auto h = shared + w * shared + w * s * *x[2] +
+           constraint(*x[2] * *x[3] - *x[1] * s == 0.0, "c") + 1.5;
+  FeedDict feed_dict{{"w", 3.0}};
+
+  for (auto root : {h, shared, model.fp(5.0)}) {
+    auto [expected, expected_offset] =
+        model.create_qubo(model.compile(root), feed_dict);
+
+    DenseIndexer indexer;
+    QUBOInserter inserter(indexer);
+    model.compile_into(root, inserter, feed_dict);
+    EXPECT_DOUBLE_EQ(expected_offset, inserter.offset);
+    for (auto [term, coeff] : expected)
+      EXPECT_NEAR(coeff, inserter.quad[term], 1e-12);
+    for (auto [term, coeff] : inserter.quad)
+      EXPECT_NEAR(coeff, expected[term], 1e-12);
+  }
+
+  // Terms over quadratic of all summands are merged and reduced once.
+  auto cubic = *x[0] * *x[1] * *x[2];
+  auto [expected, expected_offset] =
+      model.create_qubo(model.compile(2.0 * cubic + cubic));
+  DenseIndexer indexer;
+  QUBOInserter inserter(indexer);
+  model.compile_into(2.0 * cubic + cubic, inserter);
+  EXPECT_EQ(expected.size(), inserter.quad.size());
+}
+
+TEST(cxqubo_test, spin) {
+  Context context;
+  CXQUBOModel model(context);
+  Array s = model.add_vars(3, Vartype::SPIN, "s");
+  auto x = model.add_binary("x");
+  auto h = (*s[0] + *s[1] + *s[2] - 1.0).pow(2) + 3.0 * *s[0] * x -
+           2.0 * *s[1] * *s[2] + x;
+
+  auto [h0, J0, offset0] = model.create_ising(model.compile(h));
+  auto spin = model.compile(h, 1, Vartype::SPIN);
+  EXPECT_EQ(Vartype::SPIN, spin.vartype);
+  auto [h1, J1, offset1] = model.create_ising(spin);
+
+  EXPECT_NEAR(offset0, offset1, 1e-12);
+  for (auto [i, coeff] : h0)
+    EXPECT_NEAR(coeff, h1[i], 1e-12);
+  for (auto [i, coeff] : h1)
+    EXPECT_NEAR(coeff, h0[i], 1e-12);
+  for (auto [ij, coeff] : J0)
+    EXPECT_NEAR(coeff, J1[ij], 1e-12);
+  for (auto [ij, coeff] : J1)
+    EXPECT_NEAR(coeff, J0[ij], 1e-12);
+
+  // Spin terms over quadratic are reduced with spin auxiliary variables.
+  auto cubic = model.compile(*s[0] * *s[1] * *s[2], 1, Vartype::SPIN);
+  auto [h2, J2, offset2] = model.create_ising(cubic);
+  std::vector<unsigned> ss;
+  for (unsigned i = 0; i != 3; ++i)
+    ss.push_back(context.expr_var((*s[i]).ref).index());
+  std::set<unsigned> vars;
+  for (auto [i, coeff] : h2)
+    vars.insert(i);
+  for (auto [ij, coeff] : J2) {
+    vars.insert(ij.first);
+    vars.insert(ij.second);
+  }
+  for (auto i : ss)
+    vars.erase(i);
+  std::vector<unsigned> aux(vars.begin(), vars.end());
+  ASSERT_FALSE(aux.empty());
+
+  for (unsigned bits = 0; bits != 8; ++bits) {
+    Sample sample;
+    double expected = 1.0;
+    for (unsigned i = 0; i != 3; ++i) {
+      sample[ss[i]] = (bits >> i) & 1 ? 1 : -1;
+      expected *= sample[ss[i]];
+    }
+    double actual = std::numeric_limits<double>::infinity();
+    for (unsigned abits = 0; abits != 1u << aux.size(); ++abits) {
+      for (unsigned i = 0, n = aux.size(); i != n; ++i)
+        sample[aux[i]] = (abits >> i) & 1 ? 1 : -1;
+      double energy = offset2;
+      for (auto [i, coeff] : h2)
+        energy += coeff * sample[i];
+      for (auto [ij, coeff] : J2)
+        energy += coeff * sample[ij.first] * sample[ij.second];
+      actual = std::min(actual, energy);
+    }
+    EXPECT_NEAR(expected, actual, 1e-12);
+  }
+}
+
+TEST(cxqubo_test, sum) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars({2, 3}, Vartype::BINARY, "x");
+  auto expect = [&](Express expected, Express actual) {
+    EXPECT_EQ(model.decode(model.compile(expected)),
+              model.decode(model.compile(actual)));
+  };
+
+  // One list per sum.
+  auto row = sum(x[1]);
+  auto data = row.data();
+  ASSERT_TRUE(data.is<List>());
+  EXPECT_EQ(3, data.as<List>().size());
+  expect(*x[1][0] + *x[1][1] + *x[1][2], row);
+  expect(*x[0][0] + *x[0][1] + *x[0][2] + *x[1][0] + *x[1][1] + *x[1][2],
+         sum(x));
+  expect(*x[0][1], sum(std::vector<Express>{*x[0][1]}));
+
+  auto cols = model.sum(x, 0);
+  ASSERT_EQ(1, cols.ndim());
+  ASSERT_EQ(3, cols.size());
+  for (unsigned j = 0; j != 3; ++j)
+    expect(*x[0][j] + *x[1][j], *cols[j]);
+  auto rows = model.sum(x, 1);
+  ASSERT_EQ(2, rows.size());
+  expect(row, *rows[1]);
+
+  expect(2.0 * *x[0][0] + *x[0][2] - 0.5 * *x[1][1],
+         weighted_sum({2.0, 0.0, 1.0, 0.0, -0.5, 0.0}, x));
+  expect((sum(x[0]) - 1.0).pow(2) + 2.0 * (*x[0][0] + *x[0][1] + *x[0][2]),
+         (*x[0][0] + *x[0][1] + *x[0][2] - 1.0).pow(2) + 2.0 * sum(x[0]));
+}
+
+TEST(cxqubo_test, quad_form) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(3, Vartype::BINARY, "x");
+  Array s = model.add_vars(2, Vartype::SPIN, "s");
+  auto expect = [&](Express expected, Express actual) {
+    EXPECT_EQ(model.decode(model.compile(expected)),
+              model.decode(model.compile(actual)));
+  };
+
+  std::vector<std::vector<double>> W = {
+      {1.0, 2.0, 0.0}, {0.0, 0.0, -3.0}, {0.5, 0.0, 0.0}};
+  auto h = quad_form(x, W, {4.0, 0.0, -1.0});
+  auto expected = *x[0] * *x[0] + 2.0 * *x[0] * *x[1] -
+                  3.0 * *x[1] * *x[2] + 0.5 * *x[2] * *x[0] +
+                  4.0 * *x[0] - *x[2];
+  expect(expected, h);
+  expect(expected + 1.0, h + 1.0);
+  EXPECT_TRUE(quad_form(x, SpanRef<QuadEntry>()).data().is<QuadForm>());
+
+  // Spin variables are rewritten into the binary domain.
+  std::vector<QuadEntry> entries = {{0, 1, 2.0}, {1, 1, 1.0}};
+  auto hs = quad_form(s, entries, {1.0, 0.0});
+  expect(2.0 * *s[0] * *s[1] + *s[1] * *s[1] + *s[0], hs);
+
+  Sample sample;
+  for (unsigned i = 0; i != 3; ++i)
+    sample[context.expr_var((*x[i]).ref).index()] = 1;
+  EXPECT_DOUBLE_EQ(3.5, model.report(model.compile(h), sample).energy);
+
+  // Fixed variables are substituted.
+  model.fix(*x[2], 1);
+  Sample fixed_sample{{context.expr_var((*x[0]).ref).index(), 1},
+                      {context.expr_var((*x[1]).ref).index(), 1}};
+  auto compiled = model.compile(h);
+  EXPECT_EQ(model.decode(model.compile(expected)), model.decode(compiled));
+  EXPECT_DOUBLE_EQ(3.5, model.report(compiled, fixed_sample).energy);
+}
+
+TEST(cxqubo_test, shared_pairs) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(4, Vartype::BINARY, "x");
+  auto x0 = *x[0], x1 = *x[1], x2 = *x[2], x3 = *x[3];
+  auto h = x0 * x1 * x2 + x0 * x1 * x3 - 2.0 * x0 * x1 * x2 * x3 + x2;
+  auto compiled = model.compile(h);
+
+  std::vector<unsigned> xs;
+  for (unsigned i = 0; i != 4; ++i)
+    xs.push_back(context.expr_var((*x[i]).ref).index());
+  auto aux_vars = [&](const Quadratic &qubo) {
+    std::set<unsigned> vars;
+    for (auto [ij, coeff] : qubo) {
+      vars.insert(ij.first);
+      vars.insert(ij.second);
+    }
+    for (auto i : xs)
+      vars.erase(i);
+    return std::vector<unsigned>(vars.begin(), vars.end());
+  };
+
+  auto [chain, chain_offset] = model.create_qubo(compiled);
+  model.set_reduction(Reduction::SharedPairs);
+  for (double strength : {DEFAULT_STRENGTH, AUTO_STRENGTH}) {
+    auto [qubo, offset] = model.create_qubo(compiled, {}, strength);
+    // x0 * x1 is shared by all, and then q * x2 by the quartic term.
+    auto aux = aux_vars(qubo);
+    EXPECT_EQ(2, aux.size());
+    EXPECT_LT(aux.size(), aux_vars(chain).size());
+
+    // Minimum over auxiliary variables equals the original energy.
+    for (unsigned bits = 0; bits != 16; ++bits) {
+      Sample sample;
+      for (unsigned i = 0; i != 4; ++i)
+        sample[xs[i]] = (bits >> i) & 1;
+      double expected = model.report(compiled, sample).energy;
+      double actual = std::numeric_limits<double>::infinity();
+      for (unsigned abits = 0; abits != 1u << aux.size(); ++abits) {
+        for (unsigned i = 0, n = aux.size(); i != n; ++i)
+          sample[aux[i]] = (abits >> i) & 1;
+        double energy = offset;
+        for (auto [ij, coeff] : qubo)
+          energy += coeff * sample[ij.first] * sample[ij.second];
+        actual = std::min(actual, energy);
+      }
+      EXPECT_DOUBLE_EQ(expected, actual);
+    }
+  }
+}
+
+TEST(cxqubo_test, strength) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(4, Vartype::BINARY, "x");
+  auto x0 = *x[0], x1 = *x[1], x2 = *x[2], x3 = *x[3];
+  auto h = x0 * x1 * x2 + x0 * x1 * x3 - 2.0 * x0 * x1 * x2 * x3 + x2;
+  auto compiled = model.compile(h);
+
+  std::vector<unsigned> xs;
+  for (unsigned i = 0; i != 4; ++i)
+    xs.push_back(context.expr_var((*x[i]).ref).index());
+  // Return the most assignments of auxiliary variables taking a minimum
+  // with the same assignment of xs.
+  auto max_ties = [&](const Quadratic &qubo, double offset) {
+    std::set<unsigned> vars;
+    for (auto [ij, coeff] : qubo) {
+      vars.insert(ij.first);
+      vars.insert(ij.second);
+    }
+    for (auto i : xs)
+      vars.erase(i);
+    std::vector<unsigned> aux(vars.begin(), vars.end());
+
+    unsigned result = 0;
+    for (unsigned bits = 0; bits != 16; ++bits) {
+      Sample sample;
+      for (unsigned i = 0; i != 4; ++i)
+        sample[xs[i]] = (bits >> i) & 1;
+      double expected = model.report(compiled, sample).energy;
+      unsigned ties = 0;
+      for (unsigned abits = 0; abits != 1u << aux.size(); ++abits) {
+        for (unsigned i = 0, n = aux.size(); i != n; ++i)
+          sample[aux[i]] = (abits >> i) & 1;
+        double energy = offset;
+        for (auto [ij, coeff] : qubo)
+          energy += coeff * sample[ij.first] * sample[ij.second];
+        EXPECT_GE(energy, expected - 1e-9);
+        ties += energy < expected + 1e-9;
+      }
+      result = std::max(result, ties);
+    }
+    return result;
+  };
+
+  for (auto reduction : {Reduction::Chain, Reduction::SharedPairs}) {
+    model.set_reduction(reduction);
+    // Only consistent auxiliary variables take minimums by default.
+    auto [qubo, offset] = model.create_qubo(compiled);
+    EXPECT_EQ(1, max_ties(qubo, offset));
+    // AUTO_STRENGTH keeps minimums, but broken reductions may tie.
+    auto [weak, weak_offset] = model.create_qubo(compiled, {}, AUTO_STRENGTH);
+    EXPECT_LT(1, max_ties(weak, weak_offset));
+  }
+}
+
+TEST(cxqubo_test, hubo) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(4, Vartype::BINARY, "x");
+  auto h = 2.0 * *x[3] * *x[1] * *x[0] - *x[0] * *x[1] * *x[2] * *x[3] +
+           *x[2] * *x[2] + 1.5;
+  auto compiled = model.compile(h);
+
+  std::vector<unsigned> to_sparse;
+  auto [poly, offset] = model.create_hubo(compiled, &to_sparse);
+  EXPECT_EQ(1.5, offset);
+  EXPECT_EQ(4, to_sparse.size());
+  std::vector<unsigned> dense(4);
+  for (unsigned i = 0; i != 4; ++i) {
+    auto var = context.expr_var((*x[i]).ref).index();
+    dense[i] = std::find(to_sparse.begin(), to_sparse.end(), var) -
+               to_sparse.begin();
+  }
+  auto term = [&](std::vector<unsigned> is) {
+    std::vector<unsigned> result;
+    for (auto i : is)
+      result.push_back(dense[i]);
+    std::sort(result.begin(), result.end());
+    return result;
+  };
+  Polynomial expected = {{term({0, 1, 3}), 2.0},
+                         {term({0, 1, 2, 3}), -1.0},
+                         {term({2}), 1.0}};
+  EXPECT_EQ(expected, poly);
+
+  // Terms over the limit are reduced.
+  auto [cubic, cubic_offset] =
+      model.create_hubo(compiled, {}, DEFAULT_STRENGTH, 3);
+  EXPECT_EQ(1.5, cubic_offset);
+  for (auto [is, coeff] : cubic)
+    EXPECT_LE(is.size(), 3);
+  EXPECT_FALSE(cubic.count(term({0, 1, 2, 3})));
 }
+
+TEST(cxqubo_test, reduction_cache) {
+  Context context;
+  CXQUBOModel model(context);
+  Array x = model.add_vars(4, Vartype::BINARY, "x");
+  auto w = model.placeholder("w");
+  auto h = w * *x[0] * *x[1] * *x[2] * *x[3] - *x[1] * *x[2] * *x[3];
+  auto compiled = model.compile(h);
+
+  for (auto reduction :
+       {Reduction::Chain, Reduction::SharedPairs, Reduction::MinSelection}) {
+    model.set_reduction(reduction);
+    std::vector<unsigned> first;
+    model.create_qubo(compiled, &first, {{"w", 2.0}});
+    auto num_vars = context.num_vars();
+    for (double value : {-3.0, 2.0, 0.5}) {
+      std::vector<unsigned> to_sparse;
+      model.create_qubo(compiled, &to_sparse, {{"w", value}});
+      EXPECT_EQ(num_vars, context.num_vars());
+      // Encodings of MinSelection depend on signs of coefficients.
+      if (reduction != Reduction::MinSelection || value > 0.0) {
+        EXPECT_EQ(first, to_sparse);
+      }
+    }
+  }
+
+  // A copy shares the reductions.
+  auto copy = compiled;
+  auto num_vars = context.num_vars();
+  model.create_qubo(copy, {{"w", 1.0}});
+  EXPECT_EQ(num_vars, context.num_vars());
 }
+} // namespace
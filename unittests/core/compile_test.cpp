@@ -6,6 +6,9 @@
 using namespace cxqubo;
 
 namespace {
+using Single = BasicSingle<AffineCoeff>;
+using Multi = BasicMulti<AffineCoeff>;
+
 TEST(parser_test, basics) {
   Context ctx;
   Sample fixs;
@@ -19,42 +22,42 @@ TEST(parser_test, basics) {
   auto e2 = ctx.variable(b2);
   auto e3 = ctx.variable(b3);
 
-  Parser parser(ctx, fixs);
+  AffineParser parser(ctx, fixs);
   auto poly = parser.parse(ctx.fp(1.2));
   EXPECT_TRUE(poly.is<Single>());
   auto single = poly.as<Single>();
   EXPECT_EQ(Product::none(), single.first);
-  EXPECT_EQ(ctx.fp(1.2), single.second);
+  EXPECT_EQ(AffineCoeff(1.2), single.second);
 
   poly = parser.parse(ctx.placeholder("v"));
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   EXPECT_EQ(Product::none(), single.first);
-  EXPECT_EQ(ctx.placeholder("v"), single.second);
+  EXPECT_EQ(AffineCoeff::placeholder(0), single.second);
 
   poly = parser.parse(e0);
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   EXPECT_EQ(ctx.save_product(b0), single.first);
-  EXPECT_EQ(ctx.fp(1.0), single.second);
+  EXPECT_EQ(AffineCoeff(1.0), single.second);
 
   poly = parser.parse(ctx.subh("subh", e1));
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   EXPECT_EQ(ctx.save_product(b1), single.first);
-  EXPECT_EQ(ctx.fp(1.0), single.second);
+  EXPECT_EQ(AffineCoeff(1.0), single.second);
 
   poly = parser.parse(ctx.constraint("constr", e2, Condition::from(0)));
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   EXPECT_EQ(ctx.save_product(b2), single.first);
-  EXPECT_EQ(ctx.fp(1.0), single.second);
+  EXPECT_EQ(AffineCoeff(1.0), single.second);
 
   poly = parser.parse(ctx.neg(e3));
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   EXPECT_EQ(ctx.save_product(b3), single.first);
-  EXPECT_EQ(ctx.fp(-1.0), single.second);
+  EXPECT_EQ(AffineCoeff(-1.0), single.second);
 
   poly = parser.parse(ctx.add(e0, e1));
   EXPECT_TRUE(poly.is<Multi>());
@@ -65,15 +68,15 @@ TEST(parser_test, basics) {
   auto p1 = ctx.save_product(b1);
   EXPECT_TRUE(contains(multi, p0));
   EXPECT_TRUE(contains(multi, p1));
-  EXPECT_EQ(ctx.fp(1.0), multi[p0]);
-  EXPECT_EQ(ctx.fp(1.0), multi[p1]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p0]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p1]);
 
   poly = parser.parse(ctx.mul(e0, e1));
   EXPECT_TRUE(poly.is<Single>());
   single = poly.as<Single>();
   p0 = ctx.save_product({b0, b1});
   EXPECT_EQ(ctx.save_product({b0, b1}), single.first);
-  EXPECT_EQ(ctx.fp(1.0), single.second);
+  EXPECT_EQ(AffineCoeff(1.0), single.second);
 
   poly = parser.parse(ctx.mul(ctx.add(e0, e1), ctx.add(e2, e3)));
   EXPECT_TRUE(poly.is<Multi>());
@@ -88,10 +91,10 @@ TEST(parser_test, basics) {
   EXPECT_TRUE(contains(multi, p1));
   EXPECT_TRUE(contains(multi, p2));
   EXPECT_TRUE(contains(multi, p3));
-  EXPECT_EQ(ctx.fp(1.0), multi[p0]);
-  EXPECT_EQ(ctx.fp(1.0), multi[p1]);
-  EXPECT_EQ(ctx.fp(1.0), multi[p2]);
-  EXPECT_EQ(ctx.fp(1.0), multi[p3]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p0]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p1]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p2]);
+  EXPECT_EQ(AffineCoeff(1.0), multi[p3]);
 
   poly = parser.parse(ctx.neg(ctx.add(e0, e1)));
   EXPECT_TRUE(poly.is<Multi>());
@@ -101,8 +104,8 @@ TEST(parser_test, basics) {
   p1 = ctx.save_product(b1);
   EXPECT_TRUE(contains(multi, p0));
   EXPECT_TRUE(contains(multi, p1));
-  EXPECT_EQ(ctx.fp(-1.0), multi[p0]);
-  EXPECT_EQ(ctx.fp(-1.0), multi[p1]);
+  EXPECT_EQ(AffineCoeff(-1.0), multi[p0]);
+  EXPECT_EQ(AffineCoeff(-1.0), multi[p1]);
 
   auto s0 = ctx.create_unnamed_var(Vartype::SPIN);
   poly = parser.parse(ctx.variable(s0));
@@ -110,21 +113,368 @@ TEST(parser_test, basics) {
   multi = poly.as<Multi>();
   EXPECT_EQ(2, multi.size());
   EXPECT_TRUE(contains(multi, Product::none()));
-  EXPECT_EQ(ctx.fp(-1.0), multi[Product::none()]);
+  EXPECT_EQ(AffineCoeff(-1.0), multi[Product::none()]);
   p0 = ctx.save_product(s0);
   EXPECT_TRUE(contains(multi, p0));
-  EXPECT_EQ(ctx.fp(2.0), multi[p0]);
+  EXPECT_EQ(AffineCoeff(2.0), multi[p0]);
 }
 
 TEST(parser_test, fixs) {
   Context ctx;
   auto s0 = ctx.create_unnamed_var(Vartype::SPIN);
   Sample fixs({{s0.index(), -1}});
-  Parser parser(ctx, fixs);
+  AffineParser parser(ctx, fixs);
   auto poly = parser.parse(ctx.variable(s0));
   EXPECT_TRUE(poly.is<Single>());
   auto single = poly.as<Single>();
   EXPECT_EQ(Product::none(), single.first);
-  EXPECT_EQ(ctx.fp(-1.0), single.second);
+  EXPECT_EQ(AffineCoeff(-1.0), single.second);
+}
+
+TEST(parser_test, numeric) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto b1 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto s2 = ctx.create_unnamed_var(Vartype::SPIN);
+  auto e0 = ctx.variable(b0);
+  auto e1 = ctx.variable(b1);
+  auto e2 = ctx.variable(s2);
+
+  NumParser parser(ctx, fixs);
+  auto poly = parser.parse(ctx.mul(ctx.fp(3.0), ctx.add(e0, e1)));
+  ASSERT_TRUE(poly.is<BasicMulti<double>>());
+  auto multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(2, multi.size());
+  EXPECT_EQ(3.0, multi[ctx.save_product(b0)]);
+  EXPECT_EQ(3.0, multi[ctx.save_product(b1)]);
+
+  poly = parser.parse(ctx.neg(ctx.mul(e0, e2)));
+  ASSERT_TRUE(poly.is<BasicMulti<double>>());
+  multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(2, multi.size());
+  EXPECT_EQ(-2.0, multi[ctx.save_product({b0, s2})]);
+  EXPECT_EQ(1.0, multi[ctx.save_product(b0)]);
+}
+
+TEST(compiler_test, coefficient_kind) {
+  Context ctx;
+  auto e0 = ctx.variable(ctx.create_unnamed_var(Vartype::BINARY));
+  auto e1 = ctx.variable(ctx.create_unnamed_var(Vartype::BINARY));
+
+  Compiler compiler(ctx);
+  auto compiled = compiler.compile(ctx.mul(ctx.fp(2.0), ctx.add(e0, e1)));
+  EXPECT_TRUE(compiled.poly.is_numeric());
+  EXPECT_EQ(2, compiled.poly.size());
+
+  auto w = ctx.placeholder("w");
+  compiled = compiler.compile(ctx.add(e0, e1));
+  EXPECT_TRUE(compiled.poly.is_numeric());
+
+  compiled = compiler.compile(ctx.mul(w, ctx.add(e0, e1)));
+  EXPECT_FALSE(compiled.poly.is_numeric());
+  EXPECT_EQ(2, compiled.poly.size());
+}
+
+TEST(compiler_test, parallel) {
+  Context ctx;
+  auto vars = ctx.create_unnamed_vars(20, Vartype::BINARY);
+  auto xs = ctx.variables(vars);
+
+  // Summands more than a chunk.
+  auto root = ctx.fp(0.0);
+  for (unsigned i = 0; i != 300; ++i) {
+    auto h = ctx.add(ctx.mul(ctx.fp(0.1 * i), xs[i % 20]), xs[(i * 7) % 20]);
+    root = ctx.add(root, ctx.pow(ctx.sub(h, ctx.fp(1.0)), 2));
+  }
+
+  // The result does not depend on the number of threads. It may differ from
+  // the serial one only in rounding errors.
+  auto serial = Compiler(ctx).compile(root);
+  auto expected = Compiler(ctx, 2).compile(root);
+  ASSERT_TRUE(serial.poly.is_numeric());
+  ASSERT_TRUE(expected.poly.is_numeric());
+  const auto &serial_poly = serial.poly.as<NumPoly>();
+  const auto &expected_poly = expected.poly.as<NumPoly>();
+  EXPECT_EQ(serial_poly.size(), expected_poly.size());
+  for (auto [term, coeff] : expected_poly)
+    EXPECT_NEAR(serial_poly.as<BasicMulti<double>>().at(term), coeff, 1e-9);
+
+  for (unsigned num_threads : {3u, 8u}) {
+    auto compiled = Compiler(ctx, num_threads).compile(root);
+    ASSERT_TRUE(compiled.poly.is_numeric());
+    const auto &poly = compiled.poly.as<NumPoly>();
+    EXPECT_EQ(expected_poly.size(), poly.size());
+    for (auto [term, coeff] : poly)
+      EXPECT_EQ(expected_poly.as<BasicMulti<double>>().at(term), coeff);
+  }
+}
+
+TEST(parser_test, affine) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto b1 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto e0 = ctx.variable(b0);
+  auto e1 = ctx.variable(b1);
+  auto a = ctx.placeholder("A");
+  auto b = ctx.placeholder("B");
+
+  // (A * 2 + B) * (e0 + e1) + 3 * e0
+  AffineParser parser(ctx, fixs);
+  auto coeff = ctx.add(ctx.mul(a, ctx.fp(2.0)), b);
+  auto poly = parser.parse(ctx.add(ctx.mul(coeff, ctx.add(e0, e1)),
+                                   ctx.mul(ctx.fp(3.0), e0)));
+  ASSERT_TRUE(poly.is_multi());
+  auto multi = poly.as<BasicMulti<AffineCoeff>>();
+  EXPECT_EQ(2, multi.size());
+
+  auto c0 = multi[ctx.save_product(b0)];
+  EXPECT_EQ(3.0, c0.constant);
+  ASSERT_EQ(2, c0.linear.size());
+  EXPECT_EQ(std::make_pair(0u, 2.0), c0.linear[0]);
+  EXPECT_EQ(std::make_pair(1u, 1.0), c0.linear[1]);
+  EXPECT_EQ(Expr::none(), c0.rest);
+
+  auto c1 = multi[ctx.save_product(b1)];
+  EXPECT_EQ(0.0, c1.constant);
+  ASSERT_EQ(2, c1.linear.size());
+  EXPECT_EQ(Expr::none(), c1.rest);
+
+  FeedDict feed_dict{{"A", 1.5}, {"B", -1.0}};
+  PlaceholderExpander expander(ctx, feed_dict);
+  EXPECT_EQ(5.0, expander.expand(c0));
+  EXPECT_EQ(2.0, expander.expand(c1));
+
+  // A * B is not affine.
+  poly = parser.parse(ctx.mul(ctx.mul(a, b), e0));
+  ASSERT_TRUE(poly.is_single());
+  auto single = poly.as<BasicSingle<AffineCoeff>>();
+  EXPECT_TRUE(single.second.linear.empty());
+  EXPECT_NE(Expr::none(), single.second.rest);
+  EXPECT_EQ(-1.5, expander.expand(single.second));
+}
+
+TEST(parser_test, shared) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto b1 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto e0 = ctx.variable(b0);
+  auto e1 = ctx.variable(b1);
+
+  // h is referenced three times but parsed once.
+  auto h = ctx.subh("h", ctx.add(ctx.add(e0, e1), ctx.fp(-1.0)));
+  auto root = ctx.add(ctx.mul(h, h), h);
+
+  NumParser parser(ctx, fixs);
+  for (int i = 0; i < 2; ++i) {
+    auto poly = parser.parse(root);
+    ASSERT_TRUE(poly.is<BasicMulti<double>>());
+    auto multi = poly.as<BasicMulti<double>>();
+    EXPECT_EQ(2.0, multi[ctx.save_product({b0, b1})]);
+    EXPECT_EQ(0.0, multi[ctx.save_product(b0)]);
+    EXPECT_EQ(0.0, multi[ctx.save_product(b1)]);
+    EXPECT_EQ(0.0, multi[Product::none()]);
+  }
+}
+
+TEST(parser_test, pow) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto s1 = ctx.create_unnamed_var(Vartype::SPIN);
+  auto b2 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto h = ctx.add(ctx.add(ctx.variable(b0), ctx.variable(s1)),
+                   ctx.add(ctx.mul(ctx.fp(2.0), ctx.variable(b2)),
+                           ctx.fp(-1.0)));
+
+  NumParser parser(ctx, fixs);
+  for (unsigned n : {2u, 3u, 5u}) {
+    auto prod = h;
+    for (unsigned i = 1; i != n; ++i)
+      prod = ctx.mul(prod, h);
+    auto expected = parser.parse(prod);
+
+    auto poly = parser.parse(ctx.pow(h, n));
+    ASSERT_TRUE(poly.is_multi());
+    EXPECT_EQ(expected.size(), poly.size());
+    for (auto [term, coeff] : poly)
+      EXPECT_DOUBLE_EQ(expected.as<BasicMulti<double>>()[term], coeff);
+  }
+
+  auto poly = parser.parse(ctx.pow(ctx.variable(b0), 3));
+  ASSERT_TRUE(poly.is_single());
+  EXPECT_EQ(ctx.save_product(b0), poly.as<BasicSingle<double>>().first);
+}
+
+TEST(parser_test, recycle) {
+  Context ctx;
+  auto x = ctx.create_unnamed_var(Vartype::BINARY);
+  auto y = ctx.create_unnamed_var(Vartype::BINARY);
+  auto px = ctx.save_product({x});
+  auto py = ctx.save_product({y});
+  auto pxy = ctx.save_product({x, y});
+
+  BasicPolyBuilder<double> builder(ctx);
+  auto make = [&] {
+    auto poly = builder.variable(x);
+    builder.add_assign(poly, builder.variable(y));
+    builder.mul_assign(poly, builder.variable(y));
+    return poly;
+  };
+
+  // A constant is multiplied in place of the other operand.
+  NumPoly poly = builder.constant(3.0);
+  builder.mul_assign(poly, make());
+  ASSERT_TRUE(poly.is_multi());
+  EXPECT_EQ(2u, poly.size());
+  EXPECT_EQ(3.0, poly.as<BasicMulti<double>>().at(pxy));
+  EXPECT_EQ(3.0, poly.as<BasicMulti<double>>().at(py));
+
+  // Storage of consumed polys is reused by later results.
+  builder.recycle(std::move(poly));
+  EXPECT_TRUE(poly.is_empty());
+  poly = make();
+  builder.add_assign(poly, builder.constant(1.0));
+  builder.finalize(poly);
+  EXPECT_EQ(3u, poly.size());
+  EXPECT_EQ(1.0, poly.as<BasicMulti<double>>().at(Product::none()));
+  EXPECT_EQ(0u, poly.as<BasicMulti<double>>().count(px));
+}
+
+TEST(parser_test, idempotent) {
+  Context ctx;
+  Sample fixs;
+  auto x = ctx.create_unnamed_var(Vartype::BINARY);
+  auto y = ctx.create_unnamed_var(Vartype::BINARY);
+  auto s = ctx.create_unnamed_var(Vartype::SPIN);
+  auto ex = ctx.variable(x);
+  auto ey = ctx.variable(y);
+  auto es = ctx.variable(s);
+
+  NumParser parser(ctx, fixs);
+  // x * x * y = x * y
+  auto poly = parser.parse(ctx.mul(ctx.mul(ex, ex), ey));
+  ASSERT_TRUE(poly.is_single());
+  EXPECT_EQ(ctx.save_product({x, y}), poly.as<BasicSingle<double>>().first);
+
+  // (x + y)^2 = x + y + 2 x y
+  poly = parser.parse(ctx.pow(ctx.add(ex, ey), 2));
+  ASSERT_TRUE(poly.is_multi());
+  auto multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(3u, multi.size());
+  EXPECT_EQ(1.0, multi.at(ctx.save_product(x)));
+  EXPECT_EQ(1.0, multi.at(ctx.save_product(y)));
+  EXPECT_EQ(2.0, multi.at(ctx.save_product({x, y})));
+
+  // s^2 = 1
+  poly = parser.parse(ctx.mul(es, es));
+  for (auto [term, coeff] : poly)
+    EXPECT_EQ(term ? 0.0 : 1.0, coeff);
+}
+
+TEST(parser_test, spin) {
+  Context ctx;
+  Sample fixs;
+  auto s0 = ctx.create_unnamed_var(Vartype::SPIN);
+  auto s1 = ctx.create_unnamed_var(Vartype::SPIN);
+  auto b2 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto e0 = ctx.variable(s0);
+  auto e1 = ctx.variable(s1);
+  auto e2 = ctx.variable(b2);
+
+  NumParser parser(ctx, fixs, Vartype::SPIN);
+  // s0^2 = 1
+  auto poly = parser.parse(ctx.mul(e0, e0));
+  ASSERT_TRUE(poly.is_single());
+  EXPECT_EQ(Product::none(), poly.as<BasicSingle<double>>().first);
+  EXPECT_EQ(1.0, poly.as<BasicSingle<double>>().second);
+
+  // (s0 + s1)^2 = 2 + 2 s0 s1
+  poly = parser.parse(ctx.pow(ctx.add(e0, e1), 2));
+  ASSERT_TRUE(poly.is_multi());
+  auto multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(2u, multi.size());
+  EXPECT_EQ(2.0, multi.at(Product::none()));
+  EXPECT_EQ(2.0, multi.at(ctx.save_product({s0, s1})));
+
+  // b2 = (s2 + 1) / 2, s0 s1 s0 = s1
+  poly = parser.parse(ctx.mul(ctx.mul(ctx.mul(e0, e1), e0), e2));
+  multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(2u, multi.size());
+  EXPECT_EQ(0.5, multi.at(ctx.save_product(s1)));
+  EXPECT_EQ(0.5, multi.at(ctx.save_product({s1, b2})));
+}
+
+TEST(parser_test, linear) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto b1 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto s2 = ctx.create_unnamed_var(Vartype::SPIN);
+  auto e0 = ctx.variable(b0);
+  auto e1 = ctx.variable(b1);
+  auto e2 = ctx.variable(s2);
+
+  // Duplicated variables are merged.
+  NumParser parser(ctx, fixs);
+  auto poly = parser.parse(ctx.add(ctx.add(e1, e0), ctx.add(e0, ctx.fp(3.0))));
+  ASSERT_TRUE(poly.is_multi());
+  auto multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(3, multi.size());
+  EXPECT_EQ(2.0, multi[ctx.save_product(b0)]);
+  EXPECT_EQ(1.0, multi[ctx.save_product(b1)]);
+  EXPECT_EQ(3.0, multi[Product::none()]);
+
+  poly = parser.parse(ctx.sub(e0, e0));
+  ASSERT_TRUE(poly.is_single());
+  EXPECT_EQ(ctx.save_product(b0), poly.as<BasicSingle<double>>().first);
+  EXPECT_EQ(0.0, poly.as<BasicSingle<double>>().second);
+
+  // (e0 + 2) * (s2 - e1) = 2 * e0 * s2 - e0 - e0 * e1 + 4 * s2 - 2 * e1 - 2
+  poly = parser.parse(ctx.mul(ctx.add(e0, ctx.fp(2.0)), ctx.sub(e2, e1)));
+  ASSERT_TRUE(poly.is_multi());
+  multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(6, multi.size());
+  EXPECT_EQ(2.0, multi[ctx.save_product({b0, s2})]);
+  EXPECT_EQ(-1.0, multi[ctx.save_product(b0)]);
+  EXPECT_EQ(-1.0, multi[ctx.save_product({b0, b1})]);
+  EXPECT_EQ(4.0, multi[ctx.save_product(s2)]);
+  EXPECT_EQ(-2.0, multi[ctx.save_product(b1)]);
+  EXPECT_EQ(-2.0, multi[Product::none()]);
+
+  // A linear poly mixed with a quadratic one.
+  poly = parser.parse(ctx.add(ctx.mul(e0, e1), ctx.add(e0, e1)));
+  ASSERT_TRUE(poly.is_multi());
+  multi = poly.as<BasicMulti<double>>();
+  EXPECT_EQ(3, multi.size());
+  EXPECT_EQ(1.0, multi[ctx.save_product({b0, b1})]);
+  EXPECT_EQ(1.0, multi[ctx.save_product(b0)]);
+  EXPECT_EQ(1.0, multi[ctx.save_product(b1)]);
+}
+
+TEST(parser_test, deep) {
+  Context ctx;
+  Sample fixs;
+  auto b0 = ctx.create_unnamed_var(Vartype::BINARY);
+  auto e0 = ctx.variable(b0);
+
+  // e_{k+1} = -(e_k + e0) nests 2 * N levels.
+  const unsigned N = 100000;
+  auto root = e0;
+  for (unsigned i = 0; i != N; ++i)
+    root = ctx.neg(ctx.add(root, e0));
+
+  NumParser parser(ctx, fixs);
+  auto poly = parser.parse(root);
+  ASSERT_TRUE(poly.is_single());
+  EXPECT_EQ(ctx.save_product(b0), poly.as<BasicSingle<double>>().first);
+  EXPECT_EQ(1.0, poly.as<BasicSingle<double>>().second);
+
+  FeedDict feed_dict;
+  ExprEnergy energy(ctx, feed_dict);
+  Sample sample({{b0.index(), 1}});
+  EXPECT_EQ(1.0, energy.compute(root, sample, Vartype::BINARY));
 }
 } // namespace
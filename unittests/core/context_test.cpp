@@ -40,6 +40,36 @@ TEST(variables_test, basics) {
   EXPECT_EQ(v0, v1);
 }
 
+TEST(variables_test, arrays) {
+  Context ctx;
+  unsigned shape[] = {2, 3};
+  auto x = ctx.create_array_vars("x", shape, Vartype::BINARY);
+  EXPECT_EQ(Variable::from(x.index() + 5), ctx.var_of("x[1][2]"));
+  EXPECT_EQ("x[0][1]", ctx.var_data(Variable::from(x.index() + 1)).name);
+  EXPECT_FALSE(ctx.contains_var("x[2][0]"));
+  EXPECT_FALSE(ctx.contains_var("x[1]"));
+  EXPECT_FALSE(ctx.contains_var("x"));
+
+  // A 0-d array is a variable named as the basename.
+  auto a = ctx.create_array_vars("a", {}, Vartype::SPIN);
+  EXPECT_TRUE(ctx.contains_var("a"));
+  EXPECT_EQ(a, ctx.var_of("a"));
+  EXPECT_EQ("a", ctx.var_data(a).name);
+  EXPECT_EQ(Vartype::SPIN, ctx.var_type(a));
+
+  // Basenames may have '['.
+  unsigned n[] = {2};
+  auto y = ctx.create_array_vars("y[0]", n, Vartype::BINARY);
+  EXPECT_EQ(Variable::from(y.index() + 1), ctx.var_of("y[0][1]"));
+  EXPECT_FALSE(ctx.contains_var("y[1]"));
+
+  // Named variables like elements of no array are kept apart.
+  auto z = ctx.create_var("z[5]", Vartype::BINARY);
+  auto zs = ctx.create_array_vars("z", n, Vartype::BINARY);
+  EXPECT_EQ(z, ctx.var_of("z[5]"));
+  EXPECT_EQ(zs, ctx.var_of("z[0]"));
+}
+
 TEST(exprs_test, basics) {
   Context ctx;
 
@@ -86,9 +116,9 @@ TEST(exprs_test, basics) {
   ASSERT_TRUE(data.is<List>());
   auto add = data.as<List>();
   EXPECT_EQ(Op::Add, add.op);
-  EXPECT_EQ(Expr::from(1), add.node->value);
-  EXPECT_NE(nullptr, add.node->next);
-  EXPECT_EQ(Expr::from(3), add.node->next->value);
+  ASSERT_EQ(2, add.size());
+  EXPECT_EQ(Expr::from(1), add[0]);
+  EXPECT_EQ(Expr::from(3), add[1]);
 
   e = ctx.mul(Expr::from(1), Expr::from(3));
   EXPECT_EQ(7, e.index());
@@ -96,9 +126,9 @@ TEST(exprs_test, basics) {
   ASSERT_TRUE(data.is<List>());
   auto mul = data.as<List>();
   EXPECT_EQ(Op::Mul, mul.op);
-  EXPECT_EQ(Expr::from(1), mul.node->value);
-  EXPECT_NE(nullptr, mul.node->next);
-  EXPECT_EQ(Expr::from(3), mul.node->next->value);
+  ASSERT_EQ(2, mul.size());
+  EXPECT_EQ(Expr::from(1), mul[0]);
+  EXPECT_EQ(Expr::from(3), mul[1]);
 
   e = ctx.sub(Expr::from(1), Expr::from(3));
   EXPECT_EQ(9, e.index());
@@ -106,9 +136,9 @@ TEST(exprs_test, basics) {
   ASSERT_TRUE(data.is<List>());
   auto sub = data.as<List>();
   EXPECT_EQ(Op::Add, sub.op);
-  EXPECT_EQ(Expr::from(1), sub.node->value);
-  EXPECT_NE(nullptr, sub.node->next);
-  data = ctx.expr_data(sub.node->next->value);
+  ASSERT_EQ(2, sub.size());
+  EXPECT_EQ(Expr::from(1), sub[0]);
+  data = ctx.expr_data(sub[1]);
   EXPECT_TRUE(data.is<Unary>());
   EXPECT_EQ(make<Unary>(Op::Neg, Expr::from(3)), data.as<Unary>());
 }
@@ -125,20 +155,18 @@ TEST(exprs_test, binop_list) {
   EXPECT_EQ(Op::Add, data.op);
   auto it = data.begin();
   EXPECT_EQ(e0, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e1, *it);
-  ASSERT_EQ(nullptr, it.next());
+  EXPECT_EQ(data.end(), std::next(it));
 
   auto rhs = ctx.add(e2, e3);
   data = ctx.expr_data(rhs).as<List>();
   EXPECT_EQ(Op::Add, data.op);
   it = data.begin();
   EXPECT_EQ(e2, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e3, *it);
-  ASSERT_EQ(nullptr, it.next());
+  EXPECT_EQ(data.end(), std::next(it));
 
   auto e = ctx.add(lhs, rhs);
   data = ctx.expr_data(e).as<List>();
@@ -146,37 +174,44 @@ TEST(exprs_test, binop_list) {
 
   it = data.begin();
   EXPECT_EQ(lhs, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e2, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e3, *it);
-  EXPECT_EQ(nullptr, it.next());
+  EXPECT_EQ(data.end(), std::next(it));
 
   e = ctx.add(lhs, e3);
   data = ctx.expr_data(e).as<List>();
   it = data.begin();
   EXPECT_EQ(e3, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e0, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e1, *it);
-  EXPECT_EQ(nullptr, it.next());
+  EXPECT_EQ(data.end(), std::next(it));
 
   e = ctx.add(e0, rhs);
   data = ctx.expr_data(e).as<List>();
   it = data.begin();
   EXPECT_EQ(e0, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e2, *it);
-  ASSERT_NE(nullptr, it.next());
   ++it;
   EXPECT_EQ(e3, *it);
-  EXPECT_EQ(nullptr, it.next());
+  EXPECT_EQ(data.end(), std::next(it));
+
+  // Lists extending the same list keep their own operands.
+  auto e4 = ctx.variable(Variable::from(4));
+  auto x = ctx.add(lhs, e2);
+  auto y = ctx.add(lhs, e4);
+  auto operands = [&](Expr e) {
+    auto list = ctx.expr_data(e).as<List>();
+    return std::vector<Expr>(list.begin(), list.end());
+  };
+  EXPECT_EQ(std::vector<Expr>({e0, e1}), operands(lhs));
+  EXPECT_EQ(std::vector<Expr>({e2, e0, e1}), operands(x));
+  EXPECT_EQ(std::vector<Expr>({e4, e0, e1}), operands(y));
+  EXPECT_EQ(std::vector<Expr>({e0, e2, e0, e1}), operands(ctx.add(e0, x)));
 }
 
 TEST(exprs_test, constfold) {
@@ -232,6 +267,54 @@ TEST(exprs_test, constfold) {
   data = ctx.expr_data(ctx.mul(v0, fminus));
   ASSERT_TRUE(data.is<Unary>());
   EXPECT_EQ(make<Unary>(Op::Neg, v0), data.as<Unary>());
+
+  data = ctx.expr_data(ctx.pow(f3, 2));
+  ASSERT_TRUE(data.is<Fp>());
+  EXPECT_EQ(make<Fp>(9.0), data.as<Fp>());
+  EXPECT_EQ(v0, ctx.pow(v0, 1));
+}
+
+TEST(exprs_test, pow) {
+  Context ctx;
+  auto v0 = ctx.variable(Variable::from(0));
+  auto v1 = ctx.variable(Variable::from(1));
+  auto sum = ctx.add(v0, v1);
+
+  auto data = ctx.expr_data(ctx.pow(sum, 3));
+  ASSERT_TRUE(data.is<Pow>());
+  EXPECT_EQ(make<Pow>(sum, 3u), data.as<Pow>());
+}
+
+TEST(exprs_test, hash_consing) {
+  Context ctx;
+  auto x = Variable::from(0);
+  auto y = Variable::from(1);
+  auto z = Variable::from(2);
+  auto build = [&] {
+    auto sum = ctx.add(ctx.add(ctx.variable(x), ctx.variable(y)),
+                       ctx.neg(ctx.variable(z)));
+    return ctx.constraint("c", ctx.pow(ctx.subh("h", sum), 2), ctx.eqz());
+  };
+
+  // Disabled by default.
+  EXPECT_NE(build(), build());
+
+  ctx.set_hash_consing(true);
+  auto e = build();
+  auto n = ctx.num_exprs();
+  EXPECT_EQ(e, build());
+  EXPECT_EQ(n, ctx.num_exprs());
+
+  // Lists are identified by their elements in order.
+  auto vx = ctx.variable(x);
+  auto vy = ctx.variable(y);
+  auto vz = ctx.variable(z);
+  auto xyz = ctx.add(ctx.add(vx, vy), vz);
+  EXPECT_EQ(xyz, ctx.add(vz, ctx.add(vx, vy)));
+  EXPECT_NE(xyz, ctx.add(vx, ctx.add(vy, vz)));
+  EXPECT_NE(ctx.add(vx, vy), ctx.mul(vx, vy));
+  EXPECT_NE(ctx.subh("h", vx), ctx.subh("g", vx));
+  EXPECT_EQ("g", ctx.expr_name(ctx.subh(std::string("g"), vx)));
 }
 
 TEST(products_test, basics) {
@@ -244,37 +327,57 @@ TEST(products_test, basics) {
   EXPECT_EQ(Product::none(), p);
   EXPECT_EQ(0, ctx.dim_of(p));
 
+  // Products of one or two variables are inline.
   p = ctx.save_product(v0, true);
-  EXPECT_EQ(Product::from(0), p);
+  EXPECT_TRUE(p.is_inline());
+  EXPECT_EQ(1, ctx.dim_of(p));
   auto data = ctx.product_data(p);
   ASSERT_EQ(1, data.size());
   EXPECT_EQ(v0, data[0]);
 
   p = ctx.save_product({v0, v1}, true);
-  EXPECT_EQ(Product::from(1), p);
+  EXPECT_TRUE(p.is_inline());
+  EXPECT_EQ(2, ctx.dim_of(p));
   data = ctx.product_data(p);
   ASSERT_EQ(2, data.size());
   EXPECT_EQ(v0, data[0]);
   EXPECT_EQ(v1, data[1]);
 
   p = ctx.save_product({v1, v0}, true);
-  EXPECT_EQ(Product::from(2), p);
+  EXPECT_NE(ctx.save_product({v0, v1}, true), p);
   data = ctx.product_data(p);
   ASSERT_EQ(2, data.size());
   EXPECT_EQ(v1, data[0]);
   EXPECT_EQ(v0, data[1]);
 
   p = ctx.save_product({v1, v0});
-  EXPECT_EQ(Product::from(1), p);
+  EXPECT_EQ(ctx.save_product({v0, v1}, true), p);
+  EXPECT_EQ(ctx.save_product(v0), ctx.save_product({v0, v0}));
+
+  // Data of an inline product survives copies.
+  auto copy = data;
+  data = ctx.product_data(ctx.save_product(v2));
+  ASSERT_EQ(2, copy.size());
+  EXPECT_EQ(v1, copy[0]);
+  EXPECT_EQ(v0, copy[1]);
 
+  // Repeated variables are collapsed.
   auto p2 = ctx.save_product({v1, v2});
   auto mul = ctx.mul_products(p, p2);
+  EXPECT_EQ(Product::from(0), mul);
   data = ctx.product_data(mul);
-  ASSERT_EQ(4, data.size());
+  ASSERT_EQ(3, data.size());
   EXPECT_EQ(v0, data[0]);
   EXPECT_EQ(v1, data[1]);
-  EXPECT_EQ(v1, data[2]);
-  EXPECT_EQ(v2, data[3]);
+  EXPECT_EQ(v2, data[2]);
+  EXPECT_EQ(mul, ctx.save_product({v2, v1, v0, v1}));
+  EXPECT_EQ(mul, ctx.save_product({v0, v1, v1, v2}, true));
+  EXPECT_EQ(ctx.save_product(v1), ctx.mul_vars(v1, v1));
+  EXPECT_EQ(mul, ctx.mul_products(mul, p2));
+
+  // Saved products keep no inline variables.
+  static_assert(sizeof(ProductSpan) == sizeof(SpanRef<Variable>));
+  EXPECT_EQ(std::hash<ProductSpan>()(data), std::hash<ProductData>()(data));
 }
 
 TEST(context_test, convert_sample) {
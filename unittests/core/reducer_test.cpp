@@ -1,6 +1,7 @@
 #include "cxqubo/core/reducer.h"
 #include "gtest/gtest.h"
-#include <sstream>
+#include <limits>
+#include <unordered_map>
 
 using namespace cxqubo;
 
@@ -10,15 +11,61 @@ struct TestInserter {
   std::unordered_map<Product, double> poly;
   TestInserter(Context &ctx) : ctx(ctx) {}
 
-  void insert_or_add(ConstSpan<Variable> term, double coeff) {
+  void insert_or_add(SpanRef<Variable> term, double coeff) {
     Product p = ctx.save_product(term);
     auto [it, inserted] = poly.emplace(p, coeff);
     if (!inserted)
       it->second += coeff;
   }
-  bool ignore(ConstSpan<Variable>, double) const { return false; }
+  bool ignore(SpanRef<Variable>, double) const { return false; }
+
+  double energy(const std::unordered_map<Variable, int> &values) const {
+    double result = 0.0;
+    for (auto [term, coeff] : poly) {
+      for (auto var : ctx.product_data(term))
+        coeff *= values.at(var);
+      result += coeff;
+    }
+    return result;
+  }
 };
 
+using Terms = std::vector<std::pair<std::vector<Variable>, double>>;
+
+/// Check that the minimum of the reduced polynomial over \p qs equals the
+/// sum of \p terms for all assignments of \p xs in \p vartype.
+void expect_reduced(const TestInserter &inserter, const Terms &terms,
+                    const std::vector<Variable> &xs,
+                    const std::vector<Variable> &qs,
+                    Vartype vartype = Vartype::BINARY) {
+  int low = vartype == Vartype::SPIN ? -1 : 0;
+  std::unordered_map<Variable, int> values;
+  for (unsigned bits = 0; bits != 1u << xs.size(); ++bits) {
+    for (unsigned i = 0, n = xs.size(); i != n; ++i)
+      values[xs[i]] = (bits >> i) & 1 ? 1 : low;
+    double expected = 0.0;
+    for (const auto &[vars, coeff] : terms) {
+      double value = coeff;
+      for (auto var : vars)
+        value *= values[var];
+      expected += value;
+    }
+
+    double min = std::numeric_limits<double>::infinity();
+    for (unsigned qbits = 0; qbits != 1u << qs.size(); ++qbits) {
+      for (unsigned i = 0, n = qs.size(); i != n; ++i)
+        values[qs[i]] = (qbits >> i) & 1 ? 1 : low;
+      min = std::min(min, inserter.energy(values));
+    }
+    EXPECT_DOUBLE_EQ(expected, min);
+  }
+}
+void expect_reduced(const TestInserter &inserter, double coeff,
+                    const std::vector<Variable> &xs,
+                    const std::vector<Variable> &qs) {
+  expect_reduced(inserter, Terms{{xs, coeff}}, xs, qs);
+}
+
 TEST(reducer_test, basics) {
   Context ctx;
   TestInserter inserter(ctx);
@@ -29,25 +76,9 @@ TEST(reducer_test, basics) {
   auto z = ctx.create_unnamed_var(Vartype::BINARY);
 
   auto xy = ctx.save_product({x, y});
-  auto xz = ctx.save_product({x, z});
-  auto yz = ctx.save_product({y, z});
-  auto z_ = ctx.save_product({z});
-
-  reducer.insert_Hc(z, x, y, 1.0);
-  EXPECT_EQ(4, poly.size());
-  ASSERT_TRUE(poly.contains(z_));
-  ASSERT_TRUE(poly.contains(xy));
-  ASSERT_TRUE(poly.contains(xz));
-  ASSERT_TRUE(poly.contains(yz));
-  EXPECT_EQ(3.0, poly[z_]);
-  EXPECT_EQ(1.0, poly[xy]);
-  EXPECT_EQ(-2.0, poly[xz]);
-  EXPECT_EQ(-2.0, poly[yz]);
-
-  poly.clear();
   reducer.redce_and_insert(xy, 2.0);
   EXPECT_EQ(1, poly.size());
-  ASSERT_TRUE(poly.contains(xy));
+  ASSERT_TRUE(poly.count(xy));
   EXPECT_EQ(2.0, poly[xy]);
 
   poly.clear();
@@ -60,15 +91,133 @@ TEST(reducer_test, basics) {
   auto zq = ctx.save_product({z, q});
   auto qx = ctx.save_product({q, x});
   EXPECT_EQ(5, poly.size());
-  ASSERT_TRUE(poly.contains(zq));
-  ASSERT_TRUE(poly.contains(xy));
-  ASSERT_TRUE(poly.contains(q_));
-  ASSERT_TRUE(poly.contains(yq));
-  ASSERT_TRUE(poly.contains(qx));
+  ASSERT_TRUE(poly.count(zq));
+  ASSERT_TRUE(poly.count(xy));
+  ASSERT_TRUE(poly.count(q_));
+  ASSERT_TRUE(poly.count(yq));
+  ASSERT_TRUE(poly.count(qx));
   EXPECT_EQ(1.0, poly[zq]);
   EXPECT_EQ(3.0, poly[q_]);
   EXPECT_EQ(1.0, poly[xy]);
   EXPECT_EQ(-2.0, poly[yq]);
   EXPECT_EQ(-2.0, poly[qx]);
 }
+
+TEST(reducer_test, limit) {
+  Context ctx;
+  auto xs = ctx.create_unnamed_vars(5, Vartype::BINARY);
+  auto term = ctx.save_product(xs);
+
+  for (size_t limit : {2, 3, 4}) {
+    for (double coeff : {2.0, -2.0}) {
+      TestInserter inserter(ctx);
+      auto reducer = LimitedInserter(ctx, inserter, 1.0, limit);
+      auto qs = reducer.redce_and_insert(term, coeff);
+      EXPECT_EQ(5 - limit, qs.size());
+      for (auto [product, c] : inserter.poly)
+        EXPECT_LE(ctx.dim_of(product), limit);
+      expect_reduced(inserter, coeff, xs, qs);
+    }
+  }
+
+  // Terms under the limit are inserted as they are.
+  TestInserter inserter(ctx);
+  auto reducer = LimitedInserter(ctx, inserter, 1.0, 5);
+  EXPECT_FALSE(reducer.reduces(term));
+  EXPECT_TRUE(reducer.redce_and_insert(term, 2.0).empty());
+  ASSERT_EQ(1, inserter.poly.size());
+  EXPECT_EQ(2.0, inserter.poly[term]);
+}
+
+TEST(reducer_test, min_selection) {
+  Context ctx;
+  for (unsigned dim = 3; dim != 8; ++dim) {
+    auto xs = ctx.create_unnamed_vars(dim, Vartype::BINARY);
+    auto term = ctx.save_product(xs);
+    for (double coeff : {3.0, -3.0}) {
+      TestInserter inserter(ctx);
+      // Strength must not matter.
+      auto reducer = LimitedInserter(ctx, inserter, 100.0, 2,
+                                     Vartype::BINARY, Reduction::MinSelection);
+      auto qs = reducer.redce_and_insert(term, coeff);
+      EXPECT_EQ(coeff < 0.0 ? 1 : (dim - 1) / 2, qs.size());
+      for (auto [product, c] : inserter.poly)
+        EXPECT_LE(ctx.dim_of(product), 2);
+      expect_reduced(inserter, coeff, xs, qs);
+    }
+  }
+
+  // A chain is taken if it needs fewer variables.
+  auto xs = ctx.create_unnamed_vars(5, Vartype::BINARY);
+  TestInserter inserter(ctx);
+  auto reducer = LimitedInserter(ctx, inserter, 1.0, 4, Vartype::BINARY,
+                                 Reduction::MinSelection);
+  auto qs = reducer.redce_and_insert(ctx.save_product(xs), 3.0);
+  EXPECT_EQ(1, qs.size());
+  expect_reduced(inserter, 3.0, xs, qs);
+}
+
+TEST(reducer_test, shared_pairs) {
+  Context ctx;
+  auto xs = ctx.create_unnamed_vars(4, Vartype::BINARY);
+  auto [w, x, y, z] = std::tie(xs[0], xs[1], xs[2], xs[3]);
+
+  TestInserter inserter(ctx);
+  auto reducer = LimitedInserter(ctx, inserter, 1.0, 2, Vartype::BINARY,
+                                 Reduction::SharedPairs);
+  EXPECT_TRUE(reducer.redce_and_insert(ctx.save_product({w, x, y}), 1.0)
+                  .empty());
+  EXPECT_TRUE(reducer.redce_and_insert(ctx.save_product({w, x, z}), 1.0)
+                  .empty());
+  EXPECT_TRUE(inserter.poly.empty());
+
+  // w * x is shared.
+  auto qs = reducer.flush();
+  ASSERT_EQ(1, qs.size());
+  EXPECT_TRUE(inserter.poly.count(ctx.save_product({y, qs[0]})));
+  EXPECT_TRUE(inserter.poly.count(ctx.save_product({z, qs[0]})));
+  EXPECT_TRUE(reducer.flush().empty());
+
+  // Penalties of nested shared variables keep minimums with strength 1.
+  Terms terms = {{{w, x, y, z}, -2.0},
+                 {{w, x, y}, 1.0},
+                 {{w, x, z}, 1.0},
+                 {{x, y, z}, 3.0},
+                 {{w, y, z}, -1.0}};
+  TestInserter nested(ctx);
+  auto nested_reducer = LimitedInserter(ctx, nested, 1.0, 2, Vartype::BINARY,
+                                        Reduction::SharedPairs);
+  for (const auto &[vars, coeff] : terms)
+    nested_reducer.redce_and_insert(ctx.save_product(vars), coeff);
+  qs = nested_reducer.flush();
+  EXPECT_LE(qs.size(), 4);
+  expect_reduced(nested, terms, xs, qs);
+}
+
+TEST(reducer_test, spin) {
+  Context ctx;
+  auto xs = ctx.create_unnamed_vars(4, Vartype::SPIN);
+  auto [w, x, y, z] = std::tie(xs[0], xs[1], xs[2], xs[3]);
+  Terms terms = {{{w, x, y, z}, -2.0},
+                 {{w, x, y}, 1.0},
+                 {{x, y, z}, 3.0},
+                 {{w, z}, -1.0}};
+
+  for (auto reduction :
+       {Reduction::Chain, Reduction::SharedPairs, Reduction::MinSelection}) {
+    TestInserter inserter(ctx);
+    auto reducer =
+        LimitedInserter(ctx, inserter, 5.0, 2, Vartype::SPIN, reduction);
+    for (const auto &[vars, coeff] : terms)
+      EXPECT_TRUE(
+          reducer.redce_and_insert(ctx.save_product(vars), coeff).empty());
+    auto qs = reducer.flush();
+    EXPECT_FALSE(qs.empty());
+    for (auto q : qs)
+      EXPECT_EQ(Vartype::SPIN, ctx.var_type(q));
+    for (auto [product, c] : inserter.poly)
+      EXPECT_LE(ctx.dim_of(product), 2);
+    expect_reduced(inserter, terms, xs, qs, Vartype::SPIN);
+  }
+}
 } // namespace
@@ -1,5 +1,6 @@
 #include "cxqubo/misc/allocator.h"
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <list>
 
 using namespace cxqubo;
@@ -57,10 +58,44 @@ TEST_F(allocator_test, basics) {
   EXPECT_EQ(3, *c);
 }
 
+TEST_F(allocator_test, large) {
+  TypeBumpAllocator<int> alloc;
+  int *a = (int *)alloc.allocate(1);
+  int *b = (int *)alloc.allocate(1 << 22);
+  int *c = (int *)alloc.allocate(1);
+  *a = 1;
+  std::fill(b, b + (1 << 22), 2);
+  *c = 3;
+  EXPECT_EQ(1, *a);
+  EXPECT_EQ(2, b[0]);
+  EXPECT_EQ(2, b[(1 << 22) - 1]);
+  EXPECT_EQ(3, *c);
+}
+
 TEST_F(allocator_test, dtor) {
   TypeBumpAllocator<V> alloc;
   auto *v = new (alloc.allocate()) V(-10);
   v->expect = -10;
   num_expects = 1;
 }
+
+TEST(recycler_test, reuse) {
+  Recycler<std::vector<int>, 2> recycler;
+  auto v = recycler.acquire();
+  EXPECT_TRUE(v.empty());
+
+  v.assign(100, 1);
+  const int *data = v.data();
+  recycler.recycle(std::move(v));
+  EXPECT_EQ(1u, recycler.size());
+
+  auto w = recycler.acquire();
+  EXPECT_TRUE(w.empty());
+  EXPECT_EQ(data, w.data());
+  EXPECT_EQ(0u, recycler.size());
+
+  for (int i = 0; i != 3; ++i)
+    recycler.recycle(std::vector<int>(10));
+  EXPECT_EQ(2u, recycler.size());
+}
 } // namespace
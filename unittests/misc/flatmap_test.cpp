@@ -0,0 +1,70 @@
+#include "cxqubo/misc/flatmap.h"
+#include "gtest/gtest.h"
+#include <string>
+#include <type_traits>
+
+using namespace cxqubo;
+namespace {
+TEST(flatmap_test, basics) {
+  FlatMap<unsigned, std::string> m;
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(m.end(), m.find(0));
+
+  auto [it, inserted] = m.emplace(3, "three");
+  EXPECT_TRUE(inserted);
+  EXPECT_EQ(3u, it->first);
+  EXPECT_EQ("three", it->second);
+
+  std::tie(it, inserted) = m.emplace(3, "other");
+  EXPECT_FALSE(inserted);
+  EXPECT_EQ("three", it->second);
+
+  m[5] = "five";
+  EXPECT_EQ(2u, m.size());
+  EXPECT_EQ(1u, m.count(5));
+  EXPECT_EQ(0u, m.count(4));
+  EXPECT_EQ("five", m.at(5));
+  const auto &cm = m;
+  EXPECT_EQ("three", cm.at(3));
+  EXPECT_EQ(2u, cm.size());
+
+  // Keys can not be modified through iterators.
+  static_assert(std::is_const_v<decltype(m.begin()->first)>);
+
+  FlatMap<unsigned, std::string> copy;
+  copy[7] = "seven";
+  copy = m;
+  EXPECT_EQ(m, copy);
+  EXPECT_EQ(0u, copy.count(7));
+
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(m.end(), m.find(3));
+}
+
+TEST(flatmap_test, grow) {
+  constexpr unsigned N = 10000;
+  FlatMap<unsigned, unsigned> m;
+  for (unsigned i = 0; i != N; ++i)
+    m[i * 64] += i;
+  for (unsigned i = 0; i != N; ++i)
+    m[i * 64] += i;
+  EXPECT_EQ(N, m.size());
+
+  // Iteration follows insertion order.
+  unsigned i = 0;
+  for (auto [k, v] : m) {
+    EXPECT_EQ(i * 64, k);
+    EXPECT_EQ(2 * i, v);
+    ++i;
+  }
+
+  FlatMap<unsigned, unsigned> r;
+  r.reserve(N);
+  for (unsigned i = N; i-- != 0;)
+    r.emplace(i * 64, 2 * i);
+  EXPECT_EQ(m, r);
+  r[0] = 1;
+  EXPECT_NE(m, r);
+}
+} // namespace
@@ -0,0 +1,28 @@
+#include "cxqubo/misc/strsaver.h"
+#include "gtest/gtest.h"
+#include <string>
+
+using namespace cxqubo;
+
+namespace {
+TEST(strsaver_test, intern) {
+  StringAllocator alloc;
+  StringSaver saver(alloc);
+  EXPECT_EQ("", saver.save_string(""));
+  EXPECT_FALSE(saver.contains("x[0]"));
+
+  std::string name = "x[0]";
+  auto a = saver.save_string(name);
+  name[2] = '1';
+  auto b = saver.save_string(name);
+  EXPECT_EQ("x[0]", a);
+  EXPECT_EQ("x[1]", b);
+  EXPECT_TRUE(saver.contains("x[0]"));
+  EXPECT_EQ(a.data(), saver.save_string("x[0]").data());
+
+  // Strings larger than a block are saved as well.
+  std::string large(1 << 23, 'y');
+  EXPECT_EQ(large, saver.save_string(large));
+  EXPECT_EQ(a.data(), saver.save_string("x[0]").data());
+}
+} // namespace